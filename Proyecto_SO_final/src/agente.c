@@ -5,6 +5,13 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include <getopt.h>
+#include <sched.h>
 
 /* ============================
    Definiciones compartidas
@@ -13,12 +20,25 @@
 #define MAX_NOMBRE 64
 #define MAX_PIPE   128
 
+#define MAX_REINTENTOS      8
+#define MAX_ESPERA_MS       5000
+#define TIMEOUT_RESPUESTA_MS 1000
+#define MAX_TIMEOUT_RESPUESTA_MS 8000
+#define MAX_REENVIOS        20
+#define MAX_LECTURAS_ESTADO 4000
+#define PAUSA_DEFECTO_MS    2000
+#define MAX_COMANDO         512
+#define ESPERA_CLIENTE_MS   2000
+
 typedef enum {
     MSG_REGISTRO,
     MSG_REGISTRO_OK,
     MSG_SOLICITUD,
     MSG_RESPUESTA,
-    MSG_FIN
+    MSG_FIN,
+    MSG_CANCELAR,
+    MSG_MODIFICAR,
+    MSG_BAJA
 } TipoMensaje;
 
 typedef struct {
@@ -30,13 +50,53 @@ typedef struct {
     char pipeRespuesta[MAX_PIPE];
     int codigoRespuesta;
     int horaAsignada;
+    int idReserva;
+    int reintentarMs;
+    int secuencia;
 } Mensaje;
 
+/* Pagina de estado publicada por el controlador (ver controlador.c) */
+typedef struct {
+    int horaActual;
+    int horaIni;
+    int horaFin;
+    int aforo;
+    int libres[24];
+    int simulacionTerminada;
+} DatosEstado;
+
+typedef struct {
+    atomic_uint secuencia;
+    DatosEstado datos;
+} EstadoCompartido;
+
+/* Conteo por archivo procesado; en modo demonio se devuelve al cliente */
+typedef struct {
+    int enviadas;
+    int aceptadas;
+    int reprogramadas;
+    int negadas;
+    int cambios;       /* cancelaciones y modificaciones aplicadas */
+    int omitidas;      /* filtradas localmente o invalidas */
+} ResumenTrabajo;
+
+/* Reservas aceptadas por este agente, para poder cancelarlas o
+   modificarlas desde el CSV usando el nombre de la familia. */
+typedef struct ReservaLocal {
+    char familia[MAX_NOMBRE];
+    int idReserva;
+    struct ReservaLocal *sig;
+} ReservaLocal;
+
 
 int fdRecibe = -1;          
 int fdRespuesta = -1;       
 int horaActualSimulacion = 0;
 char nombreAgente[MAX_NOMBRE] = {0};
+ReservaLocal *reservasLocales = NULL;
+const EstadoCompartido *estadoCompartido = NULL;
+int secuenciaActual = 0;
+FILE *salida = NULL;        /* stdout, o el pipe del cliente en modo demonio */
 
 
 
@@ -48,7 +108,23 @@ void enviarMensaje(int fd, Mensaje *m);
 int recibirMensaje(int fd, Mensaje *m);
 
 void registrarAgente(const char *nombre, const char *pipeRecibe, const char *pipeRespuesta);
-void enviarSolicitudes(const char *fileSolicitud);
+int enviarSolicitudes(const char *fileSolicitud, int pausaMs, ResumenTrabajo *res);
+void darDeBaja();
+int nombreControl(const char *pipeRecibe, char *dst, size_t tam);
+void ejecutarDemonio(const char *pipeRecibe);
+int atenderOrden(char *comando, int rechazar);
+int procesarOrdenes(char *buf, size_t *usado, size_t tam, int terminar);
+int enviarTrabajo(const char *archivo, const char *pipeRecibe, int pausaMs, int detener);
+void mapearEstadoCompartido(const char *pipeRecibe);
+int leerEstado(DatosEstado *d);
+int hayBloqueDisponible(const DatosEstado *d, int personas);
+ReservaLocal *buscarReservaLocal(const char *familia);
+void recordarReserva(const char *familia, int idReserva);
+static void limpiarCampo(char *campo);
+static void dormirMs(int ms);
+static long ahoraMs();
+void solicitarRespuesta(Mensaje *pedido, Mensaje *resp);
+static int esperaConJitter(int sugeridaMs, int intento);
 static void imprimirUso(const char *prog);
 
 
@@ -96,8 +172,11 @@ int recibirMensaje(int fd, Mensaje *m) {
 
 static void imprimirUso(const char *prog) {
     fprintf(stderr,
-            "Uso: %s -s nombreAgente -a fileSolicitud -p pipeRecibe\n",
-            prog);
+            "Uso: %s -s nombreAgente -a fileSolicitud -p pipeRecibe [-d pausaMs]\n"
+            "     %s -s nombreAgente -p pipeRecibe --daemon\n"
+            "     %s -s nombreAgente -j fileSolicitud [-p pipeRecibe] [-d pausaMs]\n"
+            "     %s -s nombreAgente --detener [-p pipeRecibe]\n",
+            prog, prog, prog, prog);
 }
 
 
@@ -116,71 +195,707 @@ void registrarAgente(const char *nombre, const char *pipeRecibe, const char *pip
     strncpy(m.agente, nombre, sizeof(m.agente) - 1);
     strncpy(m.pipeRespuesta, pipeRespuesta, sizeof(m.pipeRespuesta) - 1);
 
-    enviarMensaje(fdRecibe, &m);
-
-
-    fdRespuesta = abrirPipeLectura(pipeRespuesta);
+    /* Se abre antes de registrarse y sin bloquear: si el controlador cae
+       antes de replicar el registro, el standby no abrira este pipe y el
+       agente debe poder reenviar MSG_REGISTRO en lugar de quedar bloqueado */
+    fdRespuesta = open(pipeRespuesta, O_RDONLY | O_NONBLOCK);
+    if (fdRespuesta == -1) error("open lectura");
+    fcntl(fdRespuesta, F_SETFL, fcntl(fdRespuesta, F_GETFL) & ~O_NONBLOCK);
 
-    if (recibirMensaje(fdRespuesta, &m) <= 0) {
-        error("Error recibiendo MSG_REGISTRO_OK");
-    }
+    Mensaje resp;
+    solicitarRespuesta(&m, &resp);
 
-    if (m.tipo != MSG_REGISTRO_OK) {
+    if (resp.tipo != MSG_REGISTRO_OK) {
         fprintf(stderr, "Agente %s: respuesta inesperada al registrar.\n", nombre);
     }
 
-    horaActualSimulacion = m.hora;
+    horaActualSimulacion = resp.hora;
 
     printf("Agente %s registrado. Hora actual de simulacion: %d\n",
            nombre, horaActualSimulacion);
 }
 
-/* Envío de solicitudes desde el CSV */
-void enviarSolicitudes(const char *fileSolicitud) {
+/* Si el controlador no publica la pagina el agente sigue funcionando
+   solo con la hora recibida en MSG_REGISTRO_OK */
+void mapearEstadoCompartido(const char *pipeRecibe) {
+    char nombre[MAX_PIPE];
+    const char *base = strrchr(pipeRecibe, '/');
+    base = base ? base + 1 : pipeRecibe;
+    snprintf(nombre, sizeof(nombre), "/parque_%s", base);
+
+    int fd = shm_open(nombre, O_RDONLY, 0);
+    if (fd == -1) return;
+
+    void *p = mmap(NULL, sizeof(EstadoCompartido), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return;
+    estadoCompartido = (const EstadoCompartido *)p;
+}
+
+/* Lectura con seqlock: copia los datos y reintenta si el controlador
+   estaba escribiendo. Retorna 0 si no hay pagina mapeada o si la
+   secuencia no se estabiliza (un controlador que murio a mitad de
+   publicar la deja impar); el llamador usa entonces la hora recibida. */
+int leerEstado(DatosEstado *d) {
+    if (!estadoCompartido) return 0;
+
+    for (int intento = 0; intento < MAX_LECTURAS_ESTADO; intento++) {
+        if (intento > 0) sched_yield();
+        unsigned antes = atomic_load_explicit(&estadoCompartido->secuencia, memory_order_acquire);
+        if (antes & 1) continue;
+        memcpy(d, (const void *)&estadoCompartido->datos, sizeof(DatosEstado));
+        atomic_thread_fence(memory_order_acquire);
+        unsigned despues = atomic_load_explicit(&estadoCompartido->secuencia, memory_order_relaxed);
+        if (antes == despues) return 1;
+    }
+    return 0;
+}
+
+/* Mismo criterio que procesarSolicitud: algun bloque de dos horas desde
+   la hora actual con cupo para la familia */
+int hayBloqueDisponible(const DatosEstado *d, int personas) {
+    int desde = d->horaActual > d->horaIni ? d->horaActual : d->horaIni;
+    for (int h = desde; h <= d->horaFin - 1; h++) {
+        if (d->libres[h] >= personas && d->libres[h + 1] >= personas) return 1;
+    }
+    return 0;
+}
+
+ReservaLocal *buscarReservaLocal(const char *familia) {
+    ReservaLocal *act = reservasLocales;
+    while (act) {
+        if (strcmp(act->familia, familia) == 0) return act;
+        act = act->sig;
+    }
+    return NULL;
+}
+
+void recordarReserva(const char *familia, int idReserva) {
+    ReservaLocal *r = buscarReservaLocal(familia);
+    if (!r) {
+        r = (ReservaLocal *)malloc(sizeof(ReservaLocal));
+        if (!r) error("malloc ReservaLocal");
+        memset(r, 0, sizeof(ReservaLocal));
+        strncpy(r->familia, familia, sizeof(r->familia) - 1);
+        r->sig = reservasLocales;
+        reservasLocales = r;
+    }
+    r->idReserva = idReserva;
+}
+
+static void dormirMs(int ms) {
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+}
+
+static long ahoraMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/* Envia el pedido y espera la respuesta con su misma secuencia (para un
+   registro, el MSG_REGISTRO_OK). Si no llega a tiempo (o el pipe queda
+   sin escritor porque el controlador cayo y el standby aun no lo reabre)
+   se reenvia igual, duplicando el plazo en cada reenvio: el controlador
+   contesta los reenvios desde su cache sin volver a procesarlos, y un
+   registro repetido solo se confirma.
+   Con varias copias en vuelo, un OCUPADO para una no descarta a las
+   demas: una copia anterior pudo ser admitida, y su respuesta real vale
+   mas que el rechazo. El OCUPADO se devuelve solo cuando no queda copia
+   por contestar o vence el plazo. */
+void solicitarRespuesta(Mensaje *pedido, Mensaje *resp) {
+    int reenvios = 0;
+    int pendientes = 1;         /* copias enviadas aun sin contestar */
+    int ocupado = 0;
+    Mensaje rechazo;
+    long plazo = TIMEOUT_RESPUESTA_MS;
+    long enviado = ahoraMs();
+
+    enviarMensaje(fdRecibe, pedido);
+
+    while (1) {
+        long restante = plazo - (ahoraMs() - enviado);
+        struct pollfd pfd = { fdRespuesta, POLLIN, 0 };
+        int listo = restante > 0 ? poll(&pfd, 1, (int)restante) : 0;
+        if (listo == -1 && errno != EINTR) error("poll respuesta");
+
+        if (listo > 0) {
+            int n = recibirMensaje(fdRespuesta, resp);
+            if (n != (int)sizeof(Mensaje)) {
+                dormirMs(10);   /* sin escritor: conmutacion en curso */
+                continue;
+            }
+            if (resp->tipo == MSG_FIN) return;
+            if (pedido->tipo == MSG_REGISTRO) {
+                if (resp->tipo == MSG_REGISTRO_OK) return;
+                continue;
+            }
+            if (resp->secuencia != pedido->secuencia) continue;   /* de un pedido anterior */
+
+            if (resp->tipo == MSG_RESPUESTA && resp->codigoRespuesta == 8) {
+                rechazo = *resp;
+                ocupado = 1;
+                if (--pendientes > 0) continue;
+            }
+            return;
+        }
+
+        if (listo == 0) {
+            /* El controlador esta vivo pero saturado: decide el llamador */
+            if (ocupado) {
+                *resp = rechazo;
+                return;
+            }
+            if (++reenvios > MAX_REENVIOS) {
+                fprintf(stderr, "Agente %s: el controlador no responde.\n", nombreAgente);
+                exit(EXIT_FAILURE);
+            }
+            if (pedido->tipo == MSG_REGISTRO) {
+                fprintf(salida, "Agente %s: sin respuesta, reenviando registro\n", nombreAgente);
+            } else {
+                fprintf(salida, "Agente %s: sin respuesta, reenviando solicitud de familia %s\n",
+                       nombreAgente, pedido->familia);
+            }
+            plazo *= 2;
+            if (plazo > MAX_TIMEOUT_RESPUESTA_MS) plazo = MAX_TIMEOUT_RESPUESTA_MS;
+            enviado = ahoraMs();
+            pendientes++;
+            enviarMensaje(fdRecibe, pedido);
+        }
+    }
+}
+
+/* Backoff exponencial a partir de la sugerencia del controlador, con
+   jitter en [espera/2, espera] para que los agentes no reintenten a la vez */
+static int esperaConJitter(int sugeridaMs, int intento) {
+    long espera = sugeridaMs > 0 ? sugeridaMs : 100;
+    espera <<= intento;
+    if (espera > MAX_ESPERA_MS) espera = MAX_ESPERA_MS;
+    return (int)(espera / 2 + rand() % (espera / 2 + 1));
+}
+
+/* Quita BOM, comillas y espacios alrededor de un campo del CSV */
+static void limpiarCampo(char *campo) {
+    char *ini = campo;
+    if ((unsigned char)ini[0] == 0xEF && (unsigned char)ini[1] == 0xBB &&
+        (unsigned char)ini[2] == 0xBF) {
+        ini += 3;
+    }
+    while (*ini == ' ' || *ini == '"') ini++;
+
+    size_t len = strlen(ini);
+    while (len > 0 && (ini[len - 1] == ' ' || ini[len - 1] == '"' ||
+                       ini[len - 1] == '\r' || ini[len - 1] == '\n')) {
+        len--;
+    }
+    memmove(campo, ini, len);
+    campo[len] = '\0';
+}
+
+/* Envío de solicitudes desde el CSV.
+   Formatos de linea:
+     familia,hora,personas              -> MSG_SOLICITUD
+     CANCELAR,familia                   -> MSG_CANCELAR
+     MODIFICAR,familia,hora,personas    -> MSG_MODIFICAR
+   Retorna 1 si la simulacion termino, 0 al acabar el archivo y -1 si
+   no se pudo abrir. */
+int enviarSolicitudes(const char *fileSolicitud, int pausaMs, ResumenTrabajo *res) {
+    int terminada = 0;
+    memset(res, 0, sizeof(ResumenTrabajo));
+
     FILE *f = fopen(fileSolicitud, "r");
     if (!f) {
-        perror("No se pudo abrir archivo de solicitudes");
-        exit(EXIT_FAILURE);
+        fprintf(salida, "Agente %s: no se pudo abrir archivo de solicitudes %s: %s\n",
+                nombreAgente, fileSolicitud, strerror(errno));
+        return -1;
     }
 
-    char familia[MAX_NOMBRE];
-    int hora, personas;
+    char linea[256];
+    char campos[4][MAX_NOMBRE];
     Mensaje m;
 
-    while (fscanf(f, "%63[^,],%d,%d\n", familia, &hora, &personas) == 3) {
+    while (fgets(linea, sizeof(linea), f)) {
+        int n = 0;
+        char *tok = strtok(linea, ",");
+        while (tok && n < 4) {
+            strncpy(campos[n], tok, MAX_NOMBRE - 1);
+            campos[n][MAX_NOMBRE - 1] = '\0';
+            limpiarCampo(campos[n]);
+            n++;
+            tok = strtok(NULL, ",");
+        }
+        if (n == 0 || campos[0][0] == '\0') continue;
+
+        memset(&m, 0, sizeof(Mensaje));
+        strncpy(m.agente, nombreAgente, sizeof(m.agente) - 1);
+
+        if (strcmp(campos[0], "CANCELAR") == 0 || strcmp(campos[0], "MODIFICAR") == 0) {
+            int esCancelar = (campos[0][0] == 'C');
+            if ((esCancelar && n != 2) || (!esCancelar && n != 4)) {
+                fprintf(salida, "Agente %s: linea invalida en %s\n", nombreAgente, fileSolicitud);
+                res->omitidas++;
+                continue;
+            }
+
+            ReservaLocal *rl = buscarReservaLocal(campos[1]);
+            if (!rl || rl->idReserva == 0) {
+                fprintf(salida, "Agente %s: familia %s no tiene reserva aceptada, se ignora %s\n",
+                       nombreAgente, campos[1], campos[0]);
+                res->omitidas++;
+                continue;
+            }
+
+            m.tipo = esCancelar ? MSG_CANCELAR : MSG_MODIFICAR;
+            strncpy(m.familia, campos[1], sizeof(m.familia) - 1);
+            m.idReserva = rl->idReserva;
+            if (!esCancelar) {
+                m.hora = atoi(campos[2]);
+                m.personas = atoi(campos[3]);
+            }
+        } else {
+            if (n != 3) {
+                fprintf(salida, "Agente %s: linea invalida en %s\n", nombreAgente, fileSolicitud);
+                res->omitidas++;
+                continue;
+            }
+            m.tipo = MSG_SOLICITUD;
+            strncpy(m.familia, campos[0], sizeof(m.familia) - 1);
+            m.hora = atoi(campos[1]);
+            m.personas = atoi(campos[2]);
+        }
+
+        DatosEstado estado;
+        int hayEstado = leerEstado(&estado);
+        if (hayEstado) {
+            if (estado.simulacionTerminada) {
+                fprintf(salida, "Agente %s: la simulacion ya termino.\n", nombreAgente);
+                terminada = 1;
+                break;
+            }
+            horaActualSimulacion = estado.horaActual;
+        }
 
-        if (hora < horaActualSimulacion) {
-            printf("Agente %s: solicitud ignorada para familia %s, "
+        if (m.tipo != MSG_CANCELAR && m.hora < horaActualSimulacion) {
+            fprintf(salida, "Agente %s: solicitud ignorada para familia %s, "
                    "hora %d (hora actual simulacion: %d)\n",
-                   nombreAgente, familia, hora, horaActualSimulacion);
+                   nombreAgente, m.familia, m.hora, horaActualSimulacion);
+            res->omitidas++;
             continue;
         }
 
-        memset(&m, 0, sizeof(Mensaje));
-        m.tipo = MSG_SOLICITUD;
-        strncpy(m.agente, nombreAgente, sizeof(m.agente) - 1);
-        strncpy(m.familia, familia, sizeof(m.familia) - 1);
-        m.hora = hora;
-        m.personas = personas;
+        if (hayEstado && m.tipo == MSG_SOLICITUD &&
+            (m.personas > estado.aforo || !hayBloqueDisponible(&estado, m.personas))) {
+            fprintf(salida, "Agente %s: solicitud no enviada para familia %s, "
+                   "sin cupo para %d personas (hora actual simulacion: %d)\n",
+                   nombreAgente, m.familia, m.personas, horaActualSimulacion);
+            res->omitidas++;
+            continue;
+        }
+
+        fprintf(salida, "Agente %s: enviando %s -> Familia: %s, Hora: %d, Personas: %d, idReserva: %d\n",
+               nombreAgente,
+               m.tipo == MSG_SOLICITUD ? "solicitud" :
+               m.tipo == MSG_CANCELAR ? "cancelacion" : "modificacion",
+               m.familia, m.hora, m.personas, m.idReserva);
+
+        Mensaje pedido = m;
+        TipoMensaje tipoEnviado = m.tipo;
+        int intento = 0;
+        pedido.secuencia = ++secuenciaActual;
+        res->enviadas++;
+
+        while (1) {
+            solicitarRespuesta(&pedido, &m);
 
-        printf("Agente %s: enviando solicitud -> Familia: %s, Hora: %d, Personas: %d\n",
-               nombreAgente, familia, hora, personas);
+            if (m.tipo != MSG_RESPUESTA || m.codigoRespuesta != 8 || intento >= MAX_REINTENTOS) {
+                break;
+            }
 
-        enviarMensaje(fdRecibe, &m);
+            int espera = esperaConJitter(m.reintentarMs, intento++);
+            fprintf(salida, "Agente %s: controlador ocupado, reintento %d para familia %s en %d ms\n",
+                   nombreAgente, intento, pedido.familia, espera);
+            dormirMs(espera);
+        }
 
-        if (recibirMensaje(fdRespuesta, &m) <= 0) {
-            error("Error recibiendo respuesta del controlador");
+        if (m.tipo == MSG_FIN) {
+            fprintf(salida, "Agente %s: el controlador termino la simulacion.\n", nombreAgente);
+            terminada = 1;
+            break;
         }
 
-        printf("Agente %s: respuesta para familia %s -> "
-               "horaSolicitada=%d, personas=%d, codigoRespuesta=%d, horaAsignada=%d\n",
+        fprintf(salida, "Agente %s: respuesta para familia %s -> "
+               "horaSolicitada=%d, personas=%d, codigoRespuesta=%d, horaAsignada=%d, idReserva=%d\n",
                nombreAgente, m.familia, m.hora, m.personas,
-               m.codigoRespuesta, m.horaAsignada);
+               m.codigoRespuesta, m.horaAsignada, m.idReserva);
+
+        if (tipoEnviado == MSG_SOLICITUD && (m.codigoRespuesta == 1 || m.codigoRespuesta == 2)) {
+            recordarReserva(m.familia, m.idReserva);
+        } else if (tipoEnviado == MSG_CANCELAR && m.codigoRespuesta == 5) {
+            recordarReserva(m.familia, 0);
+        }
+
+        if (m.codigoRespuesta == 1) res->aceptadas++;
+        else if (m.codigoRespuesta == 2) res->reprogramadas++;
+        else if (m.codigoRespuesta == 5 || m.codigoRespuesta == 6) res->cambios++;
+        else res->negadas++;
 
-        sleep(2);
+        dormirMs(pausaMs);
     }
 
     fclose(f);
+    return terminada;
+}
+
+/* Avisa al controlador para que cierre nuestro pipe y nos saque de su
+   tabla. Si ya no hay controlador no importa: se ignora el error. */
+void darDeBaja() {
+    Mensaje m;
+    memset(&m, 0, sizeof(Mensaje));
+    m.tipo = MSG_BAJA;
+    strncpy(m.agente, nombreAgente, sizeof(m.agente) - 1);
+    if (write(fdRecibe, &m, sizeof(Mensaje)) != sizeof(Mensaje)) {
+        fprintf(stderr, "Agente %s: no se pudo enviar la baja\n", nombreAgente);
+    }
+}
+
+/* ============================
+   Modo demonio
+   ============================ */
+
+/* Ruta absoluta del pipe de control: agente_ctl_<nombre> en el
+   directorio de pipeRecibe (o el actual si no se da -p), para que
+   cliente y demonio lo encuentren desde cualquier directorio.
+   Retorna -1 si no cabe en dst. */
+int nombreControl(const char *pipeRecibe, char *dst, size_t tam) {
+    char dir[MAX_COMANDO] = {0};
+    const char *barra = pipeRecibe ? strrchr(pipeRecibe, '/') : NULL;
+    if (barra) {
+        size_t largo = (size_t)(barra - pipeRecibe);
+        if (largo == 0) largo = 1;   /* pipe en la raiz */
+        if (largo >= sizeof(dir)) return -1;
+        memcpy(dir, pipeRecibe, largo);
+        dir[largo] = '\0';
+    }
+
+    int n;
+    if (dir[0] == '/') {
+        n = snprintf(dst, tam, "%s/agente_ctl_%s", dir, nombreAgente);
+    } else {
+        char cwd[MAX_COMANDO];
+        if (!getcwd(cwd, sizeof(cwd))) error("getcwd");
+        if (barra) n = snprintf(dst, tam, "%s/%s/agente_ctl_%s", cwd, dir, nombreAgente);
+        else n = snprintf(dst, tam, "%s/agente_ctl_%s", cwd, nombreAgente);
+    }
+    return (n < 0 || (size_t)n >= tam) ? -1 : 0;
+}
+
+/* Abre para escritura el pipe que el cliente creo y ya tiene abierto
+   para lectura. NULL si el cliente ya no esta. */
+static FILE *abrirCliente(const char *pipeCliente) {
+    int fd = -1;
+    for (int esperado = 0; esperado < ESPERA_CLIENTE_MS; esperado += 10) {
+        fd = open(pipeCliente, O_WRONLY | O_NONBLOCK);
+        if (fd != -1 || errno != ENXIO) break;
+        dormirMs(10);
+    }
+    if (fd == -1) return NULL;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    FILE *cliente = fdopen(fd, "w");
+    if (!cliente) {
+        close(fd);
+        return NULL;
+    }
+    setvbuf(cliente, NULL, _IOLBF, 0);
+    return cliente;
+}
+
+/* Ejecuta una orden recibida por el pipe de control:
+     JOB <archivo> <pausaMs> <pipeCliente>
+     SALIR <pipeCliente>
+   La salida del trabajo se escribe en el pipe del cliente. Con
+   'rechazar' (el demonio ya esta terminando) el trabajo no se ejecuta y
+   el cliente recibe su linea FIN con error=demonio_terminado.
+   Retorna 1 si el demonio debe terminar. */
+int atenderOrden(char *comando, int rechazar) {
+    char orden[16] = {0};
+    char archivo[MAX_COMANDO] = {0};
+    char pipeCliente[MAX_COMANDO] = {0};
+    int pausaMs = PAUSA_DEFECTO_MS;
+    int terminar = 0;
+
+    int campos = sscanf(comando, "%15s %511s %d %511s", orden, archivo, &pausaMs, pipeCliente);
+    if (campos >= 1 && strcmp(orden, "SALIR") == 0) {
+        strncpy(pipeCliente, archivo, sizeof(pipeCliente) - 1);
+        terminar = 1;
+    } else if (campos != 4 || strcmp(orden, "JOB") != 0) {
+        fprintf(stderr, "Agente %s: orden invalida: %s\n", nombreAgente, comando);
+        return 0;
+    }
+
+    FILE *cliente = pipeCliente[0] != '\0' ? abrirCliente(pipeCliente) : NULL;
+    if (!cliente) {
+        fprintf(stderr, "Agente %s: el cliente %s ya no espera resultados\n",
+                nombreAgente, pipeCliente);
+        return terminar;
+    }
+
+    if (terminar) {
+        fprintf(cliente, "Agente %s: demonio terminando.\n", nombreAgente);
+        fclose(cliente);
+        return 1;
+    }
+
+    ResumenTrabajo res;
+    memset(&res, 0, sizeof(ResumenTrabajo));
+    int r = 0;
+
+    if (!rechazar) {
+        if (pausaMs < 0) pausaMs = 0;
+        printf("Agente %s: trabajo %s (pausa %d ms)\n", nombreAgente, archivo, pausaMs);
+        fflush(stdout);
+
+        salida = cliente;
+        r = enviarSolicitudes(archivo, pausaMs, &res);
+        salida = stdout;
+    }
+
+    fprintf(cliente, "FIN %s enviadas=%d aceptadas=%d reprogramadas=%d negadas=%d "
+            "cambios=%d omitidas=%d%s\n",
+            archivo, res.enviadas, res.aceptadas, res.reprogramadas, res.negadas,
+            res.cambios, res.omitidas,
+            rechazar ? " error=demonio_terminado" :
+            r == -1 ? " error=archivo" : r == 1 ? " simulacion=terminada" : "");
+    fclose(cliente);
+    return r == 1;
+}
+
+/* Atiende las lineas completas de buf y deja al inicio lo que quede de
+   una linea parcial. Una vez que alguna orden pide terminar, las
+   siguientes se rechazan. Retorna el nuevo valor de 'terminar'. */
+int procesarOrdenes(char *buf, size_t *usado, size_t tam, int terminar) {
+    buf[*usado] = '\0';
+
+    /* Las ordenes llegan completas (< PIPE_BUF) pero varias pueden
+       venir en la misma lectura */
+    char *ini = buf, *fin;
+    while ((fin = strchr(ini, '\n')) != NULL) {
+        *fin = '\0';
+        if (atenderOrden(ini, terminar)) terminar = 1;
+        ini = fin + 1;
+    }
+    *usado = strlen(ini);
+    memmove(buf, ini, *usado);
+    if (*usado == tam - 1) *usado = 0;   /* linea sin fin: se descarta */
+    return terminar;
+}
+
+/* Queda registrado y atiende trabajos por su pipe de control hasta que
+   la simulacion termina o recibe SALIR. Mientras espera tambien vigila
+   su pipe de respuesta para enterarse de MSG_FIN. Al terminar contesta
+   las ordenes que quedaron en el pipe para que ningun cliente espere
+   para siempre. */
+void ejecutarDemonio(const char *pipeRecibe) {
+    char ruta[MAX_COMANDO];
+    if (nombreControl(pipeRecibe, ruta, sizeof(ruta)) == -1) {
+        fprintf(stderr, "Agente %s: ruta del pipe de control demasiado larga\n", nombreAgente);
+        return;
+    }
+    crearPipeSiNoExiste(ruta);
+
+    /* O_RDWR: que los clientes cierren su extremo no produce EOF */
+    int fdControl = open(ruta, O_RDWR);
+    if (fdControl == -1) error("open pipe de control");
+
+    printf("Agente %s: demonio esperando trabajos en %s\n", nombreAgente, ruta);
+    fflush(stdout);
+
+    char buf[MAX_COMANDO * 4];
+    size_t usado = 0;
+    int terminar = 0;
+
+    while (!terminar) {
+        struct pollfd pfd[2] = {
+            { fdControl, POLLIN, 0 },
+            { fdRespuesta, POLLIN, 0 }
+        };
+        int listo = poll(pfd, 2, 500);
+        if (listo == -1) {
+            if (errno == EINTR) continue;
+            error("poll demonio");
+        }
+
+        DatosEstado estado;
+        if (leerEstado(&estado) && estado.simulacionTerminada) break;
+
+        if (pfd[1].revents) {
+            Mensaje m;
+            int n = recibirMensaje(fdRespuesta, &m);
+            if (n == (int)sizeof(Mensaje) && m.tipo == MSG_FIN) break;
+            if (n == 0) dormirMs(10);   /* sin escritor: conmutacion en curso */
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            ssize_t n = read(fdControl, buf + usado, sizeof(buf) - 1 - usado);
+            if (n <= 0) continue;
+            usado += (size_t)n;
+            terminar = procesarOrdenes(buf, &usado, sizeof(buf), terminar);
+        }
+    }
+
+    /* Sin el nombre ya no llegan clientes nuevos; los que escribieron
+       antes reciben su rechazo. Un cliente que escriba despues lo nota
+       porque el pipe desaparece o queda sin lector. */
+    unlink(ruta);
+    fcntl(fdControl, F_SETFL, fcntl(fdControl, F_GETFL) | O_NONBLOCK);
+    while (1) {
+        ssize_t n = read(fdControl, buf + usado, sizeof(buf) - 1 - usado);
+        if (n <= 0) break;
+        usado += (size_t)n;
+        procesarOrdenes(buf, &usado, sizeof(buf), 1);
+    }
+    close(fdControl);
+}
+
+/* Nombre del pipe del cliente en curso, para borrarlo aunque lo corten */
+static char pipeClienteActivo[MAX_COMANDO + 16];
+
+static void borrarPipeCliente(int sig) {
+    unlink(pipeClienteActivo);
+    _exit(128 + sig);
+}
+
+/* El demonio sigue vivo si su pipe de control existe y tiene lector */
+static int demonioVivo(const char *ruta) {
+    int fd = open(ruta, O_WRONLY | O_NONBLOCK);
+    if (fd == -1) return 0;
+    close(fd);
+    return 1;
+}
+
+/* Escribe la orden de una vez (cabe en PIPE_BUF) y cierra el pipe de
+   control. Con muchas ordenes en espera el pipe se llena: el cliente
+   no se bloquea, informa y se retira. Retorna 1 si se entrego. */
+static int entregarOrden(int fdControl, const char *comando, size_t largo) {
+    ssize_t escrito = write(fdControl, comando, largo);
+    int err = errno;
+    close(fdControl);
+    if (escrito == (ssize_t)largo) return 1;
+
+    if (err == EAGAIN) {
+        fprintf(stderr, "Agente %s: demonio ocupado, demasiadas ordenes en espera\n", nombreAgente);
+    } else {
+        fprintf(stderr, "Agente %s: no se pudo entregar la orden: %s\n", nombreAgente, strerror(err));
+    }
+    return 0;
+}
+
+/* Copia a stdout lo que el demonio escribe en el pipe del cliente. Hasta
+   que el demonio lo abre, read da 0 sin escritor; una vez que escribio
+   algo, 0 marca el fin del trabajo. Mientras espera su turno revisa que
+   el demonio siga vivo. */
+static int esperarResultados(int fd, const char *ruta) {
+    int conectado = 0;
+    char buf[1024];
+
+    while (1) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int listo = poll(&pfd, 1, 500);
+        if (listo == -1) {
+            if (errno == EINTR) continue;
+            perror("poll pipe cliente");
+            return EXIT_FAILURE;
+        }
+
+        if (listo > 0) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n > 0) {
+                fwrite(buf, 1, (size_t)n, stdout);
+                fflush(stdout);
+                conectado = 1;
+                continue;
+            }
+            if (n == 0 && conectado) return EXIT_SUCCESS;
+            if (n == -1 && errno != EAGAIN) {
+                perror("read pipe cliente");
+                return EXIT_FAILURE;
+            }
+            dormirMs(50);   /* el demonio aun no llega a esta orden */
+        }
+
+        if (!conectado && !demonioVivo(ruta)) {
+            fprintf(stderr, "Agente %s: el demonio termino sin atender la orden\n", nombreAgente);
+            return EXIT_FAILURE;
+        }
+    }
+}
+
+/* Cliente: entrega un trabajo al demonio del agente por su pipe de
+   control y copia a stdout los resultados a medida que llegan. Nunca se
+   bloquea esperando a un demonio que ya no va a contestar. */
+int enviarTrabajo(const char *archivo, const char *pipeRecibe, int pausaMs, int detener) {
+    char ruta[MAX_COMANDO];
+    if (nombreControl(pipeRecibe, ruta, sizeof(ruta)) == -1) {
+        fprintf(stderr, "Agente %s: ruta del pipe de control demasiado larga\n", nombreAgente);
+        return EXIT_FAILURE;
+    }
+    /* Junto al pipe de control: la ruta ya es absoluta */
+    snprintf(pipeClienteActivo, sizeof(pipeClienteActivo), "%s_%d", ruta, (int)getpid());
+    const char *pipeCliente = pipeClienteActivo;
+
+    int fdControl = open(ruta, O_WRONLY | O_NONBLOCK);
+    if (fdControl == -1) {
+        fprintf(stderr, "Agente %s: no hay demonio en %s: %s\n", nombreAgente, ruta, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, borrarPipeCliente);
+    signal(SIGTERM, borrarPipeCliente);
+
+    /* Abierto antes de enviar la orden y sin bloquear: el demonio lo
+       encuentra listo, y si nunca lo abre el cliente no queda colgado */
+    crearPipeSiNoExiste(pipeCliente);
+    int fd = open(pipeCliente, O_RDONLY | O_NONBLOCK);
+    if (fd == -1) {
+        perror("open pipe cliente");
+        close(fdControl);
+        unlink(pipeCliente);
+        return EXIT_FAILURE;
+    }
+
+    /* El demonio puede correr en otro directorio: el archivo va con ruta
+       absoluta */
+    char cwd[MAX_COMANDO];
+    if (!getcwd(cwd, sizeof(cwd))) error("getcwd");
+
+    char comando[MAX_COMANDO * 4];
+    int largo;
+    if (detener) {
+        largo = snprintf(comando, sizeof(comando), "SALIR %s\n", pipeCliente);
+    } else if (archivo[0] == '/') {
+        largo = snprintf(comando, sizeof(comando), "JOB %s %d %s\n", archivo, pausaMs, pipeCliente);
+    } else {
+        largo = snprintf(comando, sizeof(comando), "JOB %s/%s %d %s\n", cwd, archivo, pausaMs, pipeCliente);
+    }
+
+    int resultado = EXIT_FAILURE;
+
+    /* La orden debe caber en una escritura atomica y en los campos del demonio */
+    if (largo < 0 || largo >= MAX_COMANDO) {
+        fprintf(stderr, "Agente %s: ruta demasiado larga\n", nombreAgente);
+        close(fdControl);
+    } else if (entregarOrden(fdControl, comando, (size_t)largo)) {
+        resultado = esperarResultados(fd, ruta);
+    }
+
+    close(fd);
+    unlink(pipeCliente);
+    return resultado;
 }
 
 /* main */
@@ -190,9 +905,17 @@ int main(int argc, char *argv[]) {
     char pipeRespuesta[128] = {0};
 
     int opt;
-    int flagNombre = 0, flagArchivo = 0, flagPipe = 0;
+    int flagNombre = 0, flagArchivo = 0, flagPipe = 0, flagTrabajo = 0;
+    int modoDemonio = 0, detener = 0;
+    int pausaMs = PAUSA_DEFECTO_MS;
+
+    static struct option opcionesLargas[] = {
+        {"daemon", no_argument, NULL, 'D'},
+        {"detener", no_argument, NULL, 'X'},
+        {NULL, 0, NULL, 0}
+    };
 
-    while ((opt = getopt(argc, argv, "s:a:p:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "s:a:p:j:d:", opcionesLargas, NULL)) != -1) {
         switch (opt) {
             case 's':
                 strncpy(nombreAgente, optarg, sizeof(nombreAgente) - 1);
@@ -200,22 +923,39 @@ int main(int argc, char *argv[]) {
                 flagNombre = 1;
                 break;
             case 'a':
+            case 'j':
                 strncpy(archivo, optarg, sizeof(archivo) - 1);
                 archivo[sizeof(archivo) - 1] = '\0';
-                flagArchivo = 1;
+                if (opt == 'a') flagArchivo = 1;
+                else flagTrabajo = 1;
                 break;
             case 'p':
                 strncpy(pipeRecibe, optarg, sizeof(pipeRecibe) - 1);
                 pipeRecibe[sizeof(pipeRecibe) - 1] = '\0';
                 flagPipe = 1;
                 break;
+            case 'd':
+                pausaMs = atoi(optarg);
+                break;
+            case 'D':
+                modoDemonio = 1;
+                break;
+            case 'X':
+                detener = 1;
+                break;
             default:
                 imprimirUso(argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
 
-    if (!flagNombre || !flagArchivo || !flagPipe) {
+    salida = stdout;
+
+    if (flagNombre && (flagTrabajo || detener)) {
+        return enviarTrabajo(archivo, flagPipe ? pipeRecibe : NULL, pausaMs, detener);
+    }
+
+    if (!flagNombre || !flagPipe || (modoDemonio == flagArchivo) || pausaMs < 0) {
         imprimirUso(argv[0]);
         exit(EXIT_FAILURE);
     }
@@ -223,13 +963,44 @@ int main(int argc, char *argv[]) {
     snprintf(pipeRespuesta, sizeof(pipeRespuesta),
              "pipe_resp_%s", nombreAgente);
 
+    srand((unsigned)time(NULL) ^ (unsigned)getpid());
+    signal(SIGPIPE, SIG_IGN);
+
     registrarAgente(nombreAgente, pipeRecibe, pipeRespuesta);
-    enviarSolicitudes(archivo);
+    mapearEstadoCompartido(pipeRecibe);
+
+    int terminada;
+    if (modoDemonio) {
+        ejecutarDemonio(pipeRecibe);
+        DatosEstado estado;
+        terminada = leerEstado(&estado) && estado.simulacionTerminada;
+    } else {
+        ResumenTrabajo res;
+        terminada = enviarSolicitudes(archivo, pausaMs, &res);
+        if (terminada == -1) {
+            /* Ya registrado: sin la baja el controlador conservaria su pipe */
+            darDeBaja();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!terminada) darDeBaja();
 
     printf("Agente %s termina.\n", nombreAgente);
 
     if (fdRecibe != -1) close(fdRecibe);
     if (fdRespuesta != -1) close(fdRespuesta);
 
+    if (estadoCompartido) {
+        munmap((void *)estadoCompartido, sizeof(EstadoCompartido));
+    }
+
+    ReservaLocal *r = reservasLocales;
+    while (r) {
+        ReservaLocal *tmp = r;
+        r = r->sig;
+        free(tmp);
+    }
+
     return 0;
 }
@@ -6,6 +6,11 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <pthread.h>
+#include <getopt.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
 
 
 
@@ -14,12 +19,24 @@
 #define MIN_HORA   7
 #define MAX_HORA   19
 
+#define MARCA_ALTA_DEFECTO  64
+#define MARCA_BAJA_DEFECTO  32
+#define REINTENTO_MS_BASE   100
+
+#define TAM_LOG_REPLICA     65536
+#define PERIODO_LATIDO_MS   20
+#define LIMITE_LATIDO_MS    150
+#define PERIODO_SONDEO_MS   5
+
 typedef enum {
     MSG_REGISTRO,
     MSG_REGISTRO_OK,
     MSG_SOLICITUD,
     MSG_RESPUESTA,
-    MSG_FIN
+    MSG_FIN,
+    MSG_CANCELAR,
+    MSG_MODIFICAR,
+    MSG_BAJA
 } TipoMensaje;
 
 typedef struct {
@@ -29,15 +46,73 @@ typedef struct {
     int hora;
     int personas;
     char pipeRespuesta[MAX_PIPE];
-    int codigoRespuesta;   /* 1=OK, 2=REPROG, 3=NEGADA_EXTEMP, 4=NEGADA_SIN_OPCION */
+    int codigoRespuesta;   /* 1=OK, 2=REPROG, 3=NEGADA_EXTEMP, 4=NEGADA_SIN_OPCION,
+                              5=CANCELADA, 6=MODIFICADA, 7=NEGADA_CAMBIO,
+                              8=OCUPADO (reintentar tras reintentarMs) */
     int horaAsignada;
+    int idReserva;         /* 0 = sin reserva asociada */
+    int reintentarMs;
+    int secuencia;         /* por agente; un reenvio repite la misma */
 } Mensaje;
 
+/* Replicacion hacia el controlador en espera (--standby). El primario
+   agrega una entrada por cada decision, con lock tomado, y publica
+   'escritas' con release; el standby las aplica en el mismo orden. */
+typedef enum {
+    REP_REGISTRO,
+    REP_RESPUESTA,
+    REP_TICK,
+    REP_FIN,
+    REP_BAJA
+} TipoReplica;
+
+typedef struct {
+    TipoReplica tipo;
+    TipoMensaje tipoPedido;    /* solo en REP_RESPUESTA: que se respondio */
+    Mensaje mensaje;
+} EntradaReplica;
+
+typedef struct {
+    pid_t pidPrimario;
+    atomic_ulong latido;       /* ms de CLOCK_MONOTONIC */
+    atomic_ulong inicioHora;   /* ms del ultimo tick, para retomar el reloj */
+    atomic_ulong escritas;
+    EntradaReplica log[TAM_LOG_REPLICA];
+} SegmentoReplica;
+
+/* Pagina compartida de solo lectura para los agentes (shm_open + mmap).
+   Protegida con seqlock: el controlador deja secuencia impar mientras
+   escribe y los lectores reintentan si la ven impar o si cambio. */
+typedef struct {
+    int horaActual;
+    int horaIni;
+    int horaFin;
+    int aforo;
+    int libres[24];            /* aforo - ocupacion por hora */
+    int simulacionTerminada;
+} DatosEstado;
+
+typedef struct {
+    atomic_uint secuencia;
+    DatosEstado datos;
+} EstadoCompartido;
+
+/* Cola circular acotada entre el hilo lector del pipe y el de admision */
+typedef struct {
+    Mensaje *mensajes;
+    int capacidad;
+    int inicio;
+    int cantidad;
+} ColaMensajes;
+
 typedef struct Reserva {
+    int id;
+    char agente[MAX_NOMBRE];
     char familia[MAX_NOMBRE];
     int personas;
     int horaInicio;
     int horaFin;      /* horaInicio + 2 */
+    struct Reserva *ant;
     struct Reserva *sig;
 } Reserva;
 
@@ -45,9 +120,29 @@ typedef struct AgenteInfo {
     char nombre[MAX_NOMBRE];
     char pipeRespuesta[MAX_PIPE];
     int fdRespuesta;
+    ColaMensajes cola;          /* ingreso propio, atendido por DRR */
+    int peso;                   /* quantum DRR en mensajes por ronda */
+    int deficit;
+    double tasa;                /* solicitudes/s del token bucket, 0 = sin limite */
+    double tokens;
+    struct timespec ultimaRecarga;
+    int atendidas;
+    int encoladas;
+    int maxCola;
+    int limitadas;
+    int ultimaSecuencia;        /* para responder reenvios sin reprocesar */
+    Mensaje ultimaRespuesta;
     struct AgenteInfo *sig;
 } AgenteInfo;
 
+/* Peso y limite de tasa configurados con -w / -r, aplicados al registrar */
+typedef struct ConfigAgente {
+    char nombre[MAX_NOMBRE];
+    int peso;
+    double tasa;
+    struct ConfigAgente *sig;
+} ConfigAgente;
+
 typedef struct {
     int ocupacion[24];      
     int horaActual;
@@ -57,9 +152,55 @@ typedef struct {
     int cantNegadas;
     int cantReprog;
     int cantAceptadasOriginal;
-    Reserva *reservas;
+    int cantCanceladas;
+    int cantModificadas;
+    Reserva *reservasPorHora[24];  /* listas por horaInicio */
+    Reserva **tablaReservas;   /* indexada por id, NULL si cancelada */
+    int capReservas;
+    int sigIdReserva;
 } EstadoParque;
 
+/* Copias tomadas bajo lock para imprimir sin bloquear la admision */
+typedef struct {
+    char familia[MAX_NOMBRE];
+    int personas;
+} FamiliaSnapshot;
+
+typedef struct {
+    int hora;
+    int ocupacion;
+    int enRango;
+    FamiliaSnapshot *salen;
+    int nSalen;
+    FamiliaSnapshot *entran;
+    int nEntran;
+    int capacidad;         /* de cada arreglo; solo crece */
+} SnapshotHora;
+
+typedef struct {
+    char nombre[MAX_NOMBRE];
+    int peso;
+    double tasa;
+    int atendidas;
+    int encoladas;
+    int maxCola;
+    int limitadas;
+} EstadisticasAgente;
+
+/* Estadisticas de agentes que se dieron de baja, para el reporte final */
+typedef struct AgenteRetirado {
+    EstadisticasAgente estadisticas;
+    struct AgenteRetirado *sig;
+} AgenteRetirado;
+
+typedef struct {
+    EstadoParque parque;   /* copia por valor, sus punteros no se usan */
+    int profundidadMaxCola;
+    int cantRechazadasOcupado;
+    EstadisticasAgente *agentes;
+    int nAgentes;
+} SnapshotReporte;
+
 
 
 EstadoParque parque;
@@ -70,27 +211,91 @@ pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 AgenteInfo *listaAgentes = NULL;
 int simulacionActiva = 1;
 
+/* listaAgentes se modifica con lock y lockCola tomados (en ese orden);
+   para recorrerla basta con cualquiera de los dos. */
+ColaMensajes colaControl;      /* registros, fin y agentes desconocidos */
+int totalEncolados = 0;
+AgenteInfo *turnoDRR = NULL;
+AgenteRetirado *agentesRetirados = NULL;
+ConfigAgente *configAgentes = NULL;
+pthread_mutex_t lockCola = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t condColaNoVacia = PTHREAD_COND_INITIALIZER;
+pthread_cond_t condColaNoLlena = PTHREAD_COND_INITIALIZER;
+int marcaAlta = MARCA_ALTA_DEFECTO;
+int marcaBaja = MARCA_BAJA_DEFECTO;
+int enSobrecarga = 0;          /* histeresis entre marcaAlta y marcaBaja */
+int profundidadMaxCola = 0;
+int cantRechazadasOcupado = 0;
+
+char nombreEstado[MAX_PIPE];
+EstadoCompartido *estadoCompartido = NULL;
+
+char nombreReplica[MAX_PIPE];
+SegmentoReplica *replica = NULL;
+int esPrimario = 1;
+int esperaPrimeraHoraMs = 0;
+
 
 
 void error(const char *msg);
 void crearPipeSiNoExiste(const char *nombre);
 int abrirPipeLectura(const char *nombre);
 int abrirPipeEscritura(const char *nombre);
-void enviarMensaje(int fd, Mensaje *m);
+int enviarMensaje(int fd, Mensaje *m);
+static long ahoraMs();
+static void dormirMs(int ms);
 int recibirMensaje(int fd, Mensaje *m);
 
 void inicializarControlador(int horaIni, int horaFin, int segHoras, int aforo, const char *pipeRecibe);
 void *hiloSolicitudes(void *arg);
+void *hiloAdmision(void *arg);
 void *hiloReloj(void *arg);
+void *hiloLatido(void *arg);
+void crearReplica(const char *pipeRecibe);
+static int replicaViva(SegmentoReplica *r);
+int abrirReplica(const char *pipeRecibe);
+void replicar(TipoReplica tipo, const Mensaje *m);
+void replicarRespuesta(TipoMensaje tipoPedido, const Mensaje *resp);
+void aplicarEntradaReplica(const EntradaReplica *e);
+int seguirPrimario();
+void tomarControl();
+void destruirReplica();
+void registrarRespuesta(Mensaje *pedido, Mensaje *resp, AgenteInfo *ag);
+int reenviarSiDuplicado(Mensaje *m);
+void moverReserva(Reserva *r, int horaInicio, int personas);
+void encolarMensaje(ColaMensajes *c, Mensaje *m);
+void desencolarMensaje(ColaMensajes *c, Mensaje *m);
+void siguienteMensaje(Mensaje *m);
+int admitirOSobrecarga(Mensaje *m);
+int consumirToken(AgenteInfo *ag);
+void responderOcupado(Mensaje *m, int reintentarMs);
+void cargarConfigAgentes(const char *lista, int esPeso);
+ConfigAgente *buscarConfigAgente(const char *nombre);
 void procesarRegistro(Mensaje *m);
+void procesarBaja(Mensaje *m);
+void eliminarAgente(AgenteInfo *ag);
+void copiarEstadisticas(const AgenteInfo *a, EstadisticasAgente *e);
 void procesarSolicitud(Mensaje *m);
+void procesarCancelacion(Mensaje *m);
+void procesarModificacion(Mensaje *m);
 int verificarBloqueDisponible(int horaInicio, int personas);
-void reservarFamilia(const char *familia, int personas, int horaInicio);
+Reserva *reservarFamilia(const char *agente, const char *familia, int personas, int horaInicio);
+Reserva *buscarReserva(int id);
+void liberarReserva(Reserva *r);
 AgenteInfo *buscarAgente(const char *nombre);
-AgenteInfo *agregarAgente(const char *nombre, const char *pipeRespuesta);
-void imprimirEstadoHora();
+AgenteInfo *agregarAgente(const char *nombre, const char *pipeRespuesta, int abrir);
+void enlazarReserva(Reserva *r);
+void desenlazarReserva(Reserva *r);
+void tomarSnapshotHora(SnapshotHora *s);
+void imprimirSnapshotHora(const SnapshotHora *s);
+void liberarSnapshotHora(SnapshotHora *s);
+void tomarSnapshotReporte(SnapshotReporte *s);
+void nombreEstadoCompartido(const char *pipeRecibe, char *dst, size_t tam);
+void crearEstadoCompartido(const char *pipeRecibe);
+void publicarEstado();
+void destruirEstadoCompartido();
 void enviarMensajeFinAgentes();
-void generarReporteFinal();
+void generarReporteFinal(const SnapshotReporte *s);
 static void imprimirUso(const char *prog);
  
 
@@ -119,11 +324,32 @@ int abrirPipeEscritura(const char *nombre) {
     return fd;
 }
 
-void enviarMensaje(int fd, Mensaje *m) {
+/* Un agente que ya termino (EPIPE) no debe tumbar al controlador */
+int enviarMensaje(int fd, Mensaje *m) {
+    if (fd == -1) return -1;   /* pipe que el standby no pudo reabrir */
     ssize_t n = write(fd, m, sizeof(Mensaje));
+    if (n == -1 && errno == EPIPE) {
+        fprintf(stderr, "Controlador: agente %s ya no escucha su pipe\n", m->agente);
+        return -1;
+    }
     if (n != sizeof(Mensaje)) {
         error("write mensaje");
     }
+    return 0;
+}
+
+static long ahoraMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void dormirMs(int ms) {
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
 }
 
 int recibirMensaje(int fd, Mensaje *m) {
@@ -147,20 +373,121 @@ AgenteInfo *buscarAgente(const char *nombre) {
     return NULL;
 }
 
-AgenteInfo *agregarAgente(const char *nombre, const char *pipeRespuesta) {
+/* Se llama con lock tomado; lockCola se toma solo para enlazar. El
+   standby registra agentes sin abrir su pipe hasta tomar el control. */
+AgenteInfo *agregarAgente(const char *nombre, const char *pipeRespuesta, int abrir) {
     AgenteInfo *nuevo = (AgenteInfo *)malloc(sizeof(AgenteInfo));
     if (!nuevo) error("malloc AgenteInfo");
 
     memset(nuevo, 0, sizeof(AgenteInfo));
     strncpy(nuevo->nombre, nombre, sizeof(nuevo->nombre) - 1);
     strncpy(nuevo->pipeRespuesta, pipeRespuesta, sizeof(nuevo->pipeRespuesta) - 1);
-    nuevo->fdRespuesta = abrirPipeEscritura(pipeRespuesta);
+    nuevo->fdRespuesta = abrir ? abrirPipeEscritura(pipeRespuesta) : -1;
+
+    nuevo->peso = 1;
+    ConfigAgente *cfg = buscarConfigAgente(nombre);
+    if (cfg) {
+        if (cfg->peso > 0) nuevo->peso = cfg->peso;
+        nuevo->tasa = cfg->tasa;
+    }
+    nuevo->tokens = nuevo->tasa > 1.0 ? nuevo->tasa : 1.0;
+    clock_gettime(CLOCK_MONOTONIC, &nuevo->ultimaRecarga);
 
+    nuevo->cola.capacidad = marcaAlta;
+    nuevo->cola.mensajes = (Mensaje *)calloc(nuevo->cola.capacidad, sizeof(Mensaje));
+    if (!nuevo->cola.mensajes) error("calloc cola agente");
+
+    pthread_mutex_lock(&lockCola);
     nuevo->sig = listaAgentes;
     listaAgentes = nuevo;
+    pthread_mutex_unlock(&lockCola);
     return nuevo;
 }
 
+void copiarEstadisticas(const AgenteInfo *a, EstadisticasAgente *e) {
+    memcpy(e->nombre, a->nombre, MAX_NOMBRE);
+    e->peso = a->peso;
+    e->tasa = a->tasa;
+    e->atendidas = a->atendidas;
+    e->encoladas = a->encoladas;
+    e->maxCola = a->maxCola;
+    e->limitadas = a->limitadas;
+}
+
+/* Con lock tomado. Descarta lo que quedara en su cola (solo pueden ser
+   reenvios ya respondidos) y conserva sus estadisticas. */
+void eliminarAgente(AgenteInfo *ag) {
+    AgenteRetirado *ret = (AgenteRetirado *)malloc(sizeof(AgenteRetirado));
+    if (!ret) error("malloc AgenteRetirado");
+
+    pthread_mutex_lock(&lockCola);
+
+    AgenteInfo **pp = &listaAgentes;
+    while (*pp && *pp != ag) pp = &(*pp)->sig;
+    if (*pp) *pp = ag->sig;
+    if (turnoDRR == ag) turnoDRR = NULL;
+    totalEncolados -= ag->cola.cantidad;
+
+    copiarEstadisticas(ag, &ret->estadisticas);
+    ret->sig = agentesRetirados;
+    agentesRetirados = ret;
+
+    pthread_mutex_unlock(&lockCola);
+
+    if (ag->fdRespuesta != -1) close(ag->fdRespuesta);
+    free(ag->cola.mensajes);
+    free(ag);
+}
+
+ConfigAgente *buscarConfigAgente(const char *nombre) {
+    ConfigAgente *act = configAgentes;
+    while (act) {
+        if (strcmp(act->nombre, nombre) == 0) return act;
+        act = act->sig;
+    }
+    return NULL;
+}
+
+/* Lista "A:3,B:1" de pesos (-w) o de solicitudes por segundo (-r) */
+void cargarConfigAgentes(const char *lista, int esPeso) {
+    char copia[512];
+    strncpy(copia, lista, sizeof(copia) - 1);
+    copia[sizeof(copia) - 1] = '\0';
+
+    for (char *tok = strtok(copia, ","); tok; tok = strtok(NULL, ",")) {
+        char *sep = strchr(tok, ':');
+        if (!sep || sep == tok) {
+            fprintf(stderr, "Configuracion de agente invalida: %s\n", tok);
+            exit(EXIT_FAILURE);
+        }
+        *sep = '\0';
+
+        ConfigAgente *cfg = buscarConfigAgente(tok);
+        if (!cfg) {
+            cfg = (ConfigAgente *)malloc(sizeof(ConfigAgente));
+            if (!cfg) error("malloc ConfigAgente");
+            memset(cfg, 0, sizeof(ConfigAgente));
+            strncpy(cfg->nombre, tok, sizeof(cfg->nombre) - 1);
+            cfg->sig = configAgentes;
+            configAgentes = cfg;
+        }
+
+        if (esPeso) {
+            cfg->peso = atoi(sep + 1);
+            if (cfg->peso <= 0) {
+                fprintf(stderr, "Peso invalido para agente %s\n", tok);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            cfg->tasa = atof(sep + 1);
+            if (cfg->tasa < 0) {
+                fprintf(stderr, "Tasa invalida para agente %s\n", tok);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
 /* ============================
    Manejo de reservas/parque
    ============================ */
@@ -177,85 +504,551 @@ int verificarBloqueDisponible(int horaInicio, int personas) {
     return 1;
 }
 
-void reservarFamilia(const char *familia, int personas, int horaInicio) {
+Reserva *reservarFamilia(const char *agente, const char *familia, int personas, int horaInicio) {
     Reserva *r = (Reserva *)malloc(sizeof(Reserva));
     if (!r) error("malloc Reserva");
 
+    if (parque.sigIdReserva >= parque.capReservas) {
+        int nuevaCap = parque.capReservas ? parque.capReservas * 2 : 64;
+        Reserva **t = (Reserva **)realloc(parque.tablaReservas, nuevaCap * sizeof(Reserva *));
+        if (!t) error("realloc tablaReservas");
+        memset(t + parque.capReservas, 0, (nuevaCap - parque.capReservas) * sizeof(Reserva *));
+        parque.tablaReservas = t;
+        parque.capReservas = nuevaCap;
+    }
+
     memset(r, 0, sizeof(Reserva));
+    r->id = parque.sigIdReserva++;
+    strncpy(r->agente, agente, sizeof(r->agente) - 1);
     strncpy(r->familia, familia, sizeof(r->familia) - 1);
     r->personas = personas;
     r->horaInicio = horaInicio;
     r->horaFin = horaInicio + 2;
 
-    r->sig = parque.reservas;
-    parque.reservas = r;
+    enlazarReserva(r);
+    parque.tablaReservas[r->id] = r;
 
     parque.ocupacion[horaInicio] += personas;
     parque.ocupacion[horaInicio + 1] += personas;
+    return r;
+}
+
+Reserva *buscarReserva(int id) {
+    if (id <= 0 || id >= parque.sigIdReserva) return NULL;
+    return parque.tablaReservas[id];
+}
+
+void liberarReserva(Reserva *r) {
+    parque.ocupacion[r->horaInicio] -= r->personas;
+    parque.ocupacion[r->horaInicio + 1] -= r->personas;
+
+    desenlazarReserva(r);
+    parque.tablaReservas[r->id] = NULL;
+    free(r);
+}
+
+void moverReserva(Reserva *r, int horaInicio, int personas) {
+    parque.ocupacion[r->horaInicio] -= r->personas;
+    parque.ocupacion[r->horaInicio + 1] -= r->personas;
+
+    desenlazarReserva(r);
+    r->horaInicio = horaInicio;
+    r->horaFin = horaInicio + 2;
+    r->personas = personas;
+    enlazarReserva(r);
+
+    parque.ocupacion[horaInicio] += personas;
+    parque.ocupacion[horaInicio + 1] += personas;
+}
+
+void enlazarReserva(Reserva *r) {
+    Reserva **cabeza = &parque.reservasPorHora[r->horaInicio];
+    r->ant = NULL;
+    r->sig = *cabeza;
+    if (*cabeza) (*cabeza)->ant = r;
+    *cabeza = r;
+}
+
+void desenlazarReserva(Reserva *r) {
+    if (r->ant) r->ant->sig = r->sig;
+    else parque.reservasPorHora[r->horaInicio] = r->sig;
+    if (r->sig) r->sig->ant = r->ant;
+    r->ant = r->sig = NULL;
+}
+
+/* ============================
+   Estado compartido con agentes
+   ============================ */
+
+/* El nombre se deriva del pipe principal para que el agente lo calcule
+   con el mismo -p que ya recibe */
+void nombreEstadoCompartido(const char *pipeRecibe, char *dst, size_t tam) {
+    const char *base = strrchr(pipeRecibe, '/');
+    base = base ? base + 1 : pipeRecibe;
+    snprintf(dst, tam, "/parque_%s", base);
+}
+
+void crearEstadoCompartido(const char *pipeRecibe) {
+    nombreEstadoCompartido(pipeRecibe, nombreEstado, sizeof(nombreEstado));
+
+    /* Tras una conmutacion la pagina ya existe y los agentes la tienen
+       mapeada: se reutiliza en lugar de recrearla */
+    int nueva = 1;
+    int fd = shm_open(nombreEstado, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd == -1 && errno == EEXIST) {
+        nueva = 0;
+        fd = shm_open(nombreEstado, O_RDWR, 0);
+    }
+    if (fd == -1) error("shm_open estado");
+    if (nueva && ftruncate(fd, sizeof(EstadoCompartido)) == -1) error("ftruncate estado");
+
+    estadoCompartido = (EstadoCompartido *)mmap(NULL, sizeof(EstadoCompartido),
+                                                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (estadoCompartido == MAP_FAILED) error("mmap estado");
+    close(fd);
+
+    if (nueva) {
+        memset(estadoCompartido, 0, sizeof(EstadoCompartido));
+        atomic_init(&estadoCompartido->secuencia, 0);
+    } else {
+        /* Un escritor que murio a mitad de publicar deja la secuencia impar */
+        unsigned sec = atomic_load(&estadoCompartido->secuencia);
+        if (sec & 1) atomic_store(&estadoCompartido->secuencia, sec + 1);
+    }
+}
+
+/* Debe llamarse con lock tomado: el mutex garantiza un solo escritor */
+void publicarEstado() {
+    if (!estadoCompartido) return;
+
+    unsigned sec = atomic_load_explicit(&estadoCompartido->secuencia, memory_order_relaxed);
+    atomic_store_explicit(&estadoCompartido->secuencia, sec + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    DatosEstado *d = &estadoCompartido->datos;
+    d->horaActual = parque.horaActual;
+    d->horaIni = parque.horaIni;
+    d->horaFin = parque.horaFin;
+    d->aforo = parque.aforo;
+    for (int h = 0; h < 24; h++) {
+        d->libres[h] = parque.aforo - parque.ocupacion[h];
+    }
+    d->simulacionTerminada = !simulacionActiva;
+
+    atomic_store_explicit(&estadoCompartido->secuencia, sec + 2, memory_order_release);
+}
+
+/* Los agentes que ya lo mapearon lo conservan hasta hacer munmap */
+void destruirEstadoCompartido() {
+    if (!estadoCompartido) return;
+    munmap(estadoCompartido, sizeof(EstadoCompartido));
+    estadoCompartido = NULL;
+    shm_unlink(nombreEstado);
+}
+
+/* ============================
+   Replicacion al standby
+   ============================ */
+
+void crearReplica(const char *pipeRecibe) {
+    const char *base = strrchr(pipeRecibe, '/');
+    base = base ? base + 1 : pipeRecibe;
+    snprintf(nombreReplica, sizeof(nombreReplica), "/parque_repl_%s", base);
+
+    /* Solo se reemplazan los restos de un primario muerto: si el segmento
+       tiene latido, otro controlador ya atiende este pipe */
+    int fd = shm_open(nombreReplica, O_RDWR, 0);
+    if (fd != -1) {
+        SegmentoReplica *previo = (SegmentoReplica *)mmap(NULL, sizeof(SegmentoReplica),
+                                                          PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (previo == MAP_FAILED) error("mmap replica");
+        int viva = replicaViva(previo);
+        pid_t pid = previo->pidPrimario;
+        munmap(previo, sizeof(SegmentoReplica));
+        if (viva) {
+            fprintf(stderr, "Controlador: ya hay un primario (pid %d) atendiendo %s; "
+                    "use --standby\n", (int)pid, pipeRecibe);
+            exit(EXIT_FAILURE);
+        }
+        shm_unlink(nombreReplica);
+    } else if (errno != ENOENT) {
+        error("shm_open replica");
+    }
+
+    fd = shm_open(nombreReplica, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1) error("shm_open replica");
+    if (ftruncate(fd, sizeof(SegmentoReplica)) == -1) error("ftruncate replica");
+
+    replica = (SegmentoReplica *)mmap(NULL, sizeof(SegmentoReplica),
+                                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (replica == MAP_FAILED) error("mmap replica");
+    close(fd);
+
+    replica->pidPrimario = getpid();
+    atomic_init(&replica->latido, ahoraMs());
+    atomic_init(&replica->inicioHora, ahoraMs());
+    atomic_init(&replica->escritas, 0);
+}
+
+/* Un segmento solo sirve si su primario sigue vivo y latiendo. Un
+   primario que cayo deja el segmento con su pid muerto o un latido viejo
+   (o en cero si cayo mientras lo creaba). */
+static int replicaViva(SegmentoReplica *r) {
+    long edad = ahoraMs() - (long)atomic_load_explicit(&r->latido, memory_order_relaxed);
+    if (r->pidPrimario <= 0 || edad > LIMITE_LATIDO_MS) return 0;
+    return kill(r->pidPrimario, 0) == 0 || errno != ESRCH;
+}
+
+/* El standby espera a que un primario vivo cree el segmento. Los restos
+   de una corrida anterior no se siguen: el proximo primario los reemplaza
+   y el standby mapea el segmento nuevo. */
+int abrirReplica(const char *pipeRecibe) {
+    const char *base = strrchr(pipeRecibe, '/');
+    base = base ? base + 1 : pipeRecibe;
+    snprintf(nombreReplica, sizeof(nombreReplica), "/parque_repl_%s", base);
+
+    int avisado = 0;
+    while (1) {
+        int fd = shm_open(nombreReplica, O_RDWR, 0);
+        if (fd == -1) {
+            if (errno != ENOENT) error("shm_open replica");
+            dormirMs(100);
+            continue;
+        }
+
+        replica = (SegmentoReplica *)mmap(NULL, sizeof(SegmentoReplica),
+                                          PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (replica == MAP_FAILED) error("mmap replica");
+        close(fd);
+
+        if (replicaViva(replica)) return 0;
+
+        munmap(replica, sizeof(SegmentoReplica));
+        replica = NULL;
+        if (!avisado) {
+            printf("Controlador standby: %s es de un primario que ya no late, "
+                   "esperando al primario\n", nombreReplica);
+            fflush(stdout);
+            avisado = 1;
+        }
+        dormirMs(100);
+    }
+}
+
+/* Con lock tomado: un solo escritor. Las entradas que no son respuestas
+   no llevan tipoPedido. */
+static void escribirEntradaReplica(TipoReplica tipo, TipoMensaje tipoPedido, const Mensaje *m) {
+    if (!replica || !esPrimario) return;
+
+    unsigned long n = atomic_load_explicit(&replica->escritas, memory_order_relaxed);
+    EntradaReplica *e = &replica->log[n % TAM_LOG_REPLICA];
+    e->tipo = tipo;
+    e->tipoPedido = tipoPedido;
+    if (m) e->mensaje = *m;
+    else memset(&e->mensaje, 0, sizeof(Mensaje));
+    atomic_store_explicit(&replica->escritas, n + 1, memory_order_release);
+}
+
+void replicar(TipoReplica tipo, const Mensaje *m) {
+    escribirEntradaReplica(tipo, (TipoMensaje)0, m);
+}
+
+void replicarRespuesta(TipoMensaje tipoPedido, const Mensaje *resp) {
+    escribirEntradaReplica(REP_RESPUESTA, tipoPedido, resp);
+}
+
+/* Con lock tomado: guarda la respuesta para contestar reenvios de la
+   misma secuencia y la replica antes de que el agente la vea */
+void registrarRespuesta(Mensaje *pedido, Mensaje *resp, AgenteInfo *ag) {
+    resp->secuencia = pedido->secuencia;
+    if (ag) {
+        ag->ultimaSecuencia = pedido->secuencia;
+        ag->ultimaRespuesta = *resp;
+    }
+    replicarRespuesta(pedido->tipo, resp);
+}
+
+/* Un agente reenvia con la misma secuencia si no recibio respuesta
+   (p. ej. durante una conmutacion). Se contesta desde la cache. */
+int reenviarSiDuplicado(Mensaje *m) {
+    if (m->secuencia <= 0) return 0;
+
+    pthread_mutex_lock(&lock);
+    AgenteInfo *ag = buscarAgente(m->agente);
+    if (!ag || m->secuencia > ag->ultimaSecuencia) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+
+    Mensaje resp = ag->ultimaRespuesta;
+    int repetir = (m->secuencia == ag->ultimaSecuencia);
+    pthread_mutex_unlock(&lock);
+
+    if (repetir) enviarMensaje(ag->fdRespuesta, &resp);
+    return 1;
+}
+
+/* Reproduce en el standby la decision que ya tomo el primario */
+void aplicarEntradaReplica(const EntradaReplica *e) {
+    const Mensaje *m = &e->mensaje;
+    AgenteInfo *ag;
+    Reserva *r;
+
+    switch (e->tipo) {
+        case REP_REGISTRO:
+            ag = buscarAgente(m->agente);
+            if (!ag) ag = agregarAgente(m->agente, m->pipeRespuesta, 0);
+            ag->ultimaSecuencia = 0;
+            break;
+
+        case REP_RESPUESTA:
+            if (e->tipoPedido == MSG_SOLICITUD) {
+                if (m->codigoRespuesta == 1 || m->codigoRespuesta == 2) {
+                    r = reservarFamilia(m->agente, m->familia, m->personas, m->horaAsignada);
+                    if (r->id != m->idReserva) {
+                        fprintf(stderr, "Controlador standby: replica desincronizada (id %d != %d)\n",
+                                r->id, m->idReserva);
+                        exit(EXIT_FAILURE);
+                    }
+                    if (m->codigoRespuesta == 1) parque.cantAceptadasOriginal++;
+                    else parque.cantReprog++;
+                } else if (m->codigoRespuesta == 4) {
+                    parque.cantNegadas++;
+                }
+            } else if (e->tipoPedido == MSG_CANCELAR && m->codigoRespuesta == 5) {
+                r = buscarReserva(m->idReserva);
+                if (r) liberarReserva(r);
+                parque.cantCanceladas++;
+            } else if (e->tipoPedido == MSG_MODIFICAR && m->codigoRespuesta == 6) {
+                r = buscarReserva(m->idReserva);
+                if (r) moverReserva(r, m->horaAsignada, m->personas);
+                parque.cantModificadas++;
+            }
+
+            ag = buscarAgente(m->agente);
+            if (ag) {
+                ag->ultimaSecuencia = m->secuencia;
+                ag->ultimaRespuesta = *m;
+            }
+            break;
+
+        case REP_TICK:
+            parque.horaActual = m->hora;
+            break;
+
+        case REP_FIN:
+            simulacionActiva = 0;
+            break;
+
+        case REP_BAJA:
+            ag = buscarAgente(m->agente);
+            if (ag) eliminarAgente(ag);
+            break;
+    }
+}
+
+/* Aplica el log mientras el primario tenga latido. Retorna 1 si hay
+   que tomar el control y 0 si el primario termino normalmente. */
+int seguirPrimario() {
+    unsigned long leidas = 0;
+
+    /* El standby reconstruye el estado aplicando el log desde la entrada
+       0; si el primario ya dio la vuelta al anillo, esa historia se perdio
+       y no hay forma de alcanzarlo */
+    unsigned long previas = atomic_load_explicit(&replica->escritas, memory_order_acquire);
+    if (previas > TAM_LOG_REPLICA) {
+        fprintf(stderr, "Controlador standby: el primario ya escribio %lu entradas (maximo %d); "
+                "el standby debe iniciarse junto con el primario\n", previas, TAM_LOG_REPLICA);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Controlador standby: siguiendo al primario (pid %d)\n", (int)replica->pidPrimario);
+    fflush(stdout);
+
+    while (1) {
+        unsigned long escritas = atomic_load_explicit(&replica->escritas, memory_order_acquire);
+
+        while (leidas < escritas) {
+            EntradaReplica e = replica->log[leidas % TAM_LOG_REPLICA];
+            /* Si el primario dio la vuelta al log mientras copiabamos, la entrada no sirve */
+            if (atomic_load_explicit(&replica->escritas, memory_order_acquire) - leidas > TAM_LOG_REPLICA) {
+                fprintf(stderr, "Controlador standby: el log de replicacion se desbordo\n");
+                exit(EXIT_FAILURE);
+            }
+            aplicarEntradaReplica(&e);
+            leidas++;
+            if (e.tipo == REP_FIN) return 0;
+        }
+
+        if (!replicaViva(replica)) {
+            int vivo = (kill(replica->pidPrimario, 0) == 0 || errno != ESRCH);
+            /* Fencing: un primario colgado no debe seguir leyendo el pipe */
+            if (vivo) kill(replica->pidPrimario, SIGKILL);
+
+            escritas = atomic_load_explicit(&replica->escritas, memory_order_acquire);
+            while (leidas < escritas) {
+                aplicarEntradaReplica(&replica->log[leidas++ % TAM_LOG_REPLICA]);
+            }
+            return 1;
+        }
+
+        dormirMs(PERIODO_SONDEO_MS);
+    }
+}
+
+/* Reabre los pipes de respuesta y retoma el reloj donde iba el primario */
+void tomarControl() {
+    int reabiertos = 0;
+
+    for (AgenteInfo *a = listaAgentes; a; a = a->sig) {
+        a->fdRespuesta = open(a->pipeRespuesta, O_WRONLY | O_NONBLOCK);
+        if (a->fdRespuesta == -1) continue;   /* el agente ya termino */
+        fcntl(a->fdRespuesta, F_SETFL, fcntl(a->fdRespuesta, F_GETFL) & ~O_NONBLOCK);
+        reabiertos++;
+    }
+
+    long transcurrido = ahoraMs() - (long)atomic_load_explicit(&replica->inicioHora, memory_order_relaxed);
+    esperaPrimeraHoraMs = horaPorSegundo * 1000 - (int)transcurrido;
+    if (esperaPrimeraHoraMs < 0) esperaPrimeraHoraMs = 0;
+
+    replica->pidPrimario = getpid();
+    atomic_store_explicit(&replica->latido, ahoraMs(), memory_order_relaxed);
+    esPrimario = 1;
+
+    printf("Controlador standby: primario sin latido, tomando el control "
+           "(hora %d, %d reservas, %d agentes reconectados)\n",
+           parque.horaActual, parque.sigIdReserva - 1, reabiertos);
+    fflush(stdout);
+}
+
+void destruirReplica() {
+    if (!replica) return;
+    munmap(replica, sizeof(SegmentoReplica));
+    replica = NULL;
+    shm_unlink(nombreReplica);
 }
 
 /* ============================
    Impresión estado por hora
    ============================ */
 
-void imprimirEstadoHora() {
+/* Copia, con lock tomado, solo las reservas que entran o salen en la
+   hora actual: las que salen empezaron dos horas antes. */
+void tomarSnapshotHora(SnapshotHora *s) {
     int hora = parque.horaActual;
+    Reserva *salen = (hora >= 2) ? parque.reservasPorHora[hora - 2] : NULL;
+    Reserva *entran = parque.reservasPorHora[hora];
+    int nSalen = 0, nEntran = 0;
+    Reserva *r;
+
+    for (r = salen; r; r = r->sig) nSalen++;
+    for (r = entran; r; r = r->sig) nEntran++;
+
+    int necesaria = nSalen > nEntran ? nSalen : nEntran;
+    if (necesaria > s->capacidad) {
+        FamiliaSnapshot *a = (FamiliaSnapshot *)realloc(s->salen, necesaria * sizeof(FamiliaSnapshot));
+        if (!a) error("realloc snapshot salen");
+        s->salen = a;
+        a = (FamiliaSnapshot *)realloc(s->entran, necesaria * sizeof(FamiliaSnapshot));
+        if (!a) error("realloc snapshot entran");
+        s->entran = a;
+        s->capacidad = necesaria;
+    }
+
+    s->hora = hora;
+    s->enRango = (hora >= parque.horaIni && hora <= parque.horaFin);
+    s->ocupacion = parque.ocupacion[hora];
+
+    s->nSalen = 0;
+    for (r = salen; r; r = r->sig) {
+        memcpy(s->salen[s->nSalen].familia, r->familia, MAX_NOMBRE);
+        s->salen[s->nSalen++].personas = r->personas;
+    }
+    s->nEntran = 0;
+    for (r = entran; r; r = r->sig) {
+        memcpy(s->entran[s->nEntran].familia, r->familia, MAX_NOMBRE);
+        s->entran[s->nEntran++].personas = r->personas;
+    }
+}
+
+void imprimirSnapshotHora(const SnapshotHora *s) {
     int salenTotal = 0;
     int entranTotal = 0;
 
     printf("--------------------------------------------------\n");
-    printf("Hora actual de simulacion: %d\n", hora);
+    printf("Hora actual de simulacion: %d\n", s->hora);
 
     printf("Salen familias: ");
-    Reserva *r = parque.reservas;
-    int primero = 1;
-    while (r) {
-        if (r->horaFin == hora) {
-            if (!primero) printf(", ");
-            printf("%s(%d)", r->familia, r->personas);
-            salenTotal += r->personas;
-            primero = 0;
-        }
-        r = r->sig;
+    for (int i = 0; i < s->nSalen; i++) {
+        if (i > 0) printf(", ");
+        printf("%s(%d)", s->salen[i].familia, s->salen[i].personas);
+        salenTotal += s->salen[i].personas;
     }
-    if (primero) printf("ninguna");
+    if (s->nSalen == 0) printf("ninguna");
     printf(" -> Total que salen: %d\n", salenTotal);
 
     printf("Entran familias: ");
-    r = parque.reservas;
-    primero = 1;
-    while (r) {
-        if (r->horaInicio == hora) {
-            if (!primero) printf(", ");
-            printf("%s(%d)", r->familia, r->personas);
-            entranTotal += r->personas;
-            primero = 0;
-        }
-        r = r->sig;
+    for (int i = 0; i < s->nEntran; i++) {
+        if (i > 0) printf(", ");
+        printf("%s(%d)", s->entran[i].familia, s->entran[i].personas);
+        entranTotal += s->entran[i].personas;
     }
-    if (primero) printf("ninguna");
+    if (s->nEntran == 0) printf("ninguna");
     printf(" -> Total que entran: %d\n", entranTotal);
 
-    if (hora >= parque.horaIni && hora <= parque.horaFin) {
+    if (s->enRango) {
         printf("Ocupacion programada para la hora %d: %d personas\n",
-               hora, parque.ocupacion[hora]);
+               s->hora, s->ocupacion);
     }
 
     printf("--------------------------------------------------\n");
 }
 
+void liberarSnapshotHora(SnapshotHora *s) {
+    free(s->salen);
+    free(s->entran);
+    memset(s, 0, sizeof(SnapshotHora));
+}
+
 /* ============================
    Reporte final
    ============================ */
 
-void generarReporteFinal() {
+void tomarSnapshotReporte(SnapshotReporte *s) {
+    pthread_mutex_lock(&lock);
+    s->parque = parque;
+    pthread_mutex_unlock(&lock);
+
+    pthread_mutex_lock(&lockCola);
+    s->profundidadMaxCola = profundidadMaxCola;
+    s->cantRechazadasOcupado = cantRechazadasOcupado;
+
+    s->nAgentes = 0;
+    for (AgenteInfo *a = listaAgentes; a; a = a->sig) s->nAgentes++;
+    for (AgenteRetirado *r = agentesRetirados; r; r = r->sig) s->nAgentes++;
+    s->agentes = (EstadisticasAgente *)calloc(s->nAgentes ? s->nAgentes : 1, sizeof(EstadisticasAgente));
+    if (!s->agentes) error("calloc snapshot agentes");
+
+    int i = 0;
+    for (AgenteInfo *a = listaAgentes; a; a = a->sig) {
+        copiarEstadisticas(a, &s->agentes[i++]);
+    }
+    for (AgenteRetirado *r = agentesRetirados; r; r = r->sig) {
+        s->agentes[i++] = r->estadisticas;
+    }
+    pthread_mutex_unlock(&lockCola);
+}
+
+void generarReporteFinal(const SnapshotReporte *s) {
+    const EstadoParque *p = &s->parque;
     int h;
     int maxOcup = -1, minOcup = 1000000;
     int horasMax[24], horasMin[24];
     int nMax = 0, nMin = 0;
 
-    for (h = parque.horaIni; h <= parque.horaFin; h++) {
-        int occ = parque.ocupacion[h];
+    for (h = p->horaIni; h <= p->horaFin; h++) {
+        int occ = p->ocupacion[h];
         if (maxOcup == -1 || occ > maxOcup) {
             maxOcup = occ;
             nMax = 0;
@@ -289,10 +1082,26 @@ void generarReporteFinal() {
     }
     printf("\n");
 
-    printf("Cantidad de solicitudes negadas: %d\n", parque.cantNegadas);
+    printf("Cantidad de solicitudes negadas: %d\n", p->cantNegadas);
     printf("Cantidad de solicitudes aceptadas en su hora original: %d\n",
-           parque.cantAceptadasOriginal);
-    printf("Cantidad de solicitudes reprogramadas: %d\n", parque.cantReprog);
+           p->cantAceptadasOriginal);
+    printf("Cantidad de solicitudes reprogramadas: %d\n", p->cantReprog);
+    printf("Cantidad de reservas canceladas: %d\n", p->cantCanceladas);
+    printf("Cantidad de reservas modificadas: %d\n", p->cantModificadas);
+    printf("Profundidad maxima de la cola de admision: %d (marcas %d/%d)\n",
+           s->profundidadMaxCola, marcaAlta, marcaBaja);
+    printf("Cantidad de solicitudes rechazadas por sobrecarga: %d\n", s->cantRechazadasOcupado);
+
+    printf("Atencion por agente:\n");
+    for (int i = 0; i < s->nAgentes; i++) {
+        const EstadisticasAgente *a = &s->agentes[i];
+        char tasa[32] = "sin limite";
+        if (a->tasa > 0) snprintf(tasa, sizeof(tasa), "%.2f/s", a->tasa);
+        printf("  %s (peso %d, tasa %s): atendidas=%d, encoladas=%d, "
+               "maxCola=%d, limitadas=%d\n",
+               a->nombre, a->peso, tasa,
+               a->atendidas, a->encoladas, a->maxCola, a->limitadas);
+    }
 
     printf("=========================================================\n");
 }
@@ -300,15 +1109,31 @@ void generarReporteFinal() {
 
 
 void enviarMensajeFinAgentes() {
-    Mensaje m;
-    memset(&m, 0, sizeof(Mensaje));
-    m.tipo = MSG_FIN;
+    /* Un MSG_BAJA concurrente puede cerrar pipes y liberar agentes: con
+       lock solo se copian nombres y fds duplicados, y se escribe sin el
+       para que un agente lento no frene la admision */
+    pthread_mutex_lock(&lock);
+    int n = 0;
+    for (AgenteInfo *a = listaAgentes; a; a = a->sig) n++;
+
+    Mensaje *fines = (Mensaje *)calloc(n > 0 ? n : 1, sizeof(Mensaje));
+    int *fds = (int *)malloc((n > 0 ? n : 1) * sizeof(int));
+    if (!fines || !fds) error("malloc fin agentes");
+
+    int i = 0;
+    for (AgenteInfo *a = listaAgentes; a; a = a->sig, i++) {
+        fines[i].tipo = MSG_FIN;
+        memcpy(fines[i].agente, a->nombre, MAX_NOMBRE);
+        fds[i] = a->fdRespuesta != -1 ? dup(a->fdRespuesta) : -1;
+    }
+    pthread_mutex_unlock(&lock);
 
-    AgenteInfo *a = listaAgentes;
-    while (a) {
-        enviarMensaje(a->fdRespuesta, &m);
-        a = a->sig;
+    for (i = 0; i < n; i++) {
+        enviarMensaje(fds[i], &fines[i]);
+        if (fds[i] != -1) close(fds[i]);
     }
+    free(fines);
+    free(fds);
 }
 
 /* ============================
@@ -320,8 +1145,10 @@ void procesarRegistro(Mensaje *m) {
 
     AgenteInfo *ag = buscarAgente(m->agente);
     if (!ag) {
-        ag = agregarAgente(m->agente, m->pipeRespuesta);
+        ag = agregarAgente(m->agente, m->pipeRespuesta, 1);
     }
+    ag->ultimaSecuencia = 0;   /* nueva sesion del agente */
+    replicar(REP_REGISTRO, m);
 
     Mensaje resp;
     memset(&resp, 0, sizeof(Mensaje));
@@ -334,6 +1161,22 @@ void procesarRegistro(Mensaje *m) {
     enviarMensaje(ag->fdRespuesta, &resp);
 }
 
+/* El agente termina (o su demonio se apaga): se cierra su pipe y se
+   saca de la tabla en lugar de dejarlo hasta el final de la simulacion */
+void procesarBaja(Mensaje *m) {
+    pthread_mutex_lock(&lock);
+
+    AgenteInfo *ag = buscarAgente(m->agente);
+    if (ag) {
+        replicar(REP_BAJA, m);
+        eliminarAgente(ag);
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    if (ag) printf("Controlador: agente %s se dio de baja\n", m->agente);
+}
+
 void procesarSolicitud(Mensaje *m) {
     pthread_mutex_lock(&lock);
 
@@ -352,6 +1195,7 @@ void procesarSolicitud(Mensaje *m) {
 
     int codigo = 0;
     int horaAsign = -1;
+    int idAsign = 0;
 
     if (personas > parque.aforo) {
         codigo = 4;
@@ -364,7 +1208,7 @@ void procesarSolicitud(Mensaje *m) {
 
         if (!extemporanea && verificarBloqueDisponible(horaReq, personas)) {
             horaAsign = horaReq;
-            reservarFamilia(m->familia, personas, horaAsign);
+            idAsign = reservarFamilia(m->agente, m->familia, personas, horaAsign)->id;
             codigo = 1;
             parque.cantAceptadasOriginal++;
         } else {
@@ -374,7 +1218,7 @@ void procesarSolicitud(Mensaje *m) {
             for (int h = startSearch; h <= parque.horaFin - 1; h++) {
                 if (verificarBloqueDisponible(h, personas)) {
                     horaAsign = h;
-                    reservarFamilia(m->familia, personas, horaAsign);
+                    idAsign = reservarFamilia(m->agente, m->familia, personas, horaAsign)->id;
                     break;
                 }
             }
@@ -391,8 +1235,109 @@ void procesarSolicitud(Mensaje *m) {
 
     resp.codigoRespuesta = codigo;
     resp.horaAsignada = horaAsign;
+    resp.idReserva = idAsign;
+
+    publicarEstado();
+    AgenteInfo *ag = buscarAgente(m->agente);
+    registrarRespuesta(m, &resp, ag);
+
+    pthread_mutex_unlock(&lock);
+
+    if (ag) {
+        enviarMensaje(ag->fdRespuesta, &resp);
+    } else {
+        fprintf(stderr, "Controlador: no se encontro agente %s para responder\n", m->agente);
+    }
+
+    printf("Controlador: peticion de agente %s, familia %s, hora %d, personas %d -> codigoRespuesta=%d, horaAsignada=%d, idReserva=%d\n",
+           m->agente, m->familia, m->hora, m->personas, resp.codigoRespuesta, resp.horaAsignada, resp.idReserva);
+}
 
+/* Cancelacion: solo el agente que hizo la reserva puede cancelarla,
+   y solo si la familia aun no ha entrado al parque: en la hora de inicio
+   el tick ya la anuncio entre las que entran. */
+void procesarCancelacion(Mensaje *m) {
+    pthread_mutex_lock(&lock);
+
+    Mensaje resp;
+    memset(&resp, 0, sizeof(Mensaje));
+    resp.tipo = MSG_RESPUESTA;
+    strncpy(resp.agente, m->agente, sizeof(resp.agente) - 1);
+    resp.idReserva = m->idReserva;
+    resp.horaAsignada = -1;
+
+    Reserva *r = buscarReserva(m->idReserva);
+    if (r && strcmp(r->agente, m->agente) == 0 && r->horaInicio > parque.horaActual) {
+        strncpy(resp.familia, r->familia, sizeof(resp.familia) - 1);
+        resp.hora = r->horaInicio;
+        resp.personas = r->personas;
+        liberarReserva(r);
+        resp.codigoRespuesta = 5;
+        parque.cantCanceladas++;
+    } else {
+        strncpy(resp.familia, m->familia, sizeof(resp.familia) - 1);
+        resp.codigoRespuesta = 7;
+    }
+
+    publicarEstado();
+    AgenteInfo *ag = buscarAgente(m->agente);
+    registrarRespuesta(m, &resp, ag);
+
+    pthread_mutex_unlock(&lock);
+
+    if (ag) {
+        enviarMensaje(ag->fdRespuesta, &resp);
+    } else {
+        fprintf(stderr, "Controlador: no se encontro agente %s para responder\n", m->agente);
+    }
+
+    printf("Controlador: cancelacion de agente %s, idReserva %d -> codigoRespuesta=%d\n",
+           m->agente, m->idReserva, resp.codigoRespuesta);
+}
+
+/* Modificacion: mueve la reserva a (hora, personas) pedidas o la deja
+   intacta. Igual que la cancelacion, solo antes de su hora de inicio.
+   La ocupacion vieja se libera antes de verificar el bloque nuevo para
+   que la familia pueda solaparse consigo misma. */
+void procesarModificacion(Mensaje *m) {
+    pthread_mutex_lock(&lock);
+
+    Mensaje resp;
+    memset(&resp, 0, sizeof(Mensaje));
+    resp.tipo = MSG_RESPUESTA;
+    strncpy(resp.agente, m->agente, sizeof(resp.agente) - 1);
+    resp.hora = m->hora;
+    resp.personas = m->personas;
+    resp.idReserva = m->idReserva;
+    resp.horaAsignada = -1;
+    resp.codigoRespuesta = 7;
+
+    Reserva *r = buscarReserva(m->idReserva);
+    if (r && strcmp(r->agente, m->agente) == 0 &&
+        r->horaInicio > parque.horaActual && m->hora >= parque.horaActual &&
+        m->personas > 0) {
+        strncpy(resp.familia, r->familia, sizeof(resp.familia) - 1);
+        resp.horaAsignada = r->horaInicio;
+
+        parque.ocupacion[r->horaInicio] -= r->personas;
+        parque.ocupacion[r->horaInicio + 1] -= r->personas;
+        int cabe = verificarBloqueDisponible(m->hora, m->personas);
+        parque.ocupacion[r->horaInicio] += r->personas;
+        parque.ocupacion[r->horaInicio + 1] += r->personas;
+
+        if (cabe) {
+            moverReserva(r, m->hora, m->personas);
+            resp.horaAsignada = r->horaInicio;
+            resp.codigoRespuesta = 6;
+            parque.cantModificadas++;
+        }
+    } else {
+        strncpy(resp.familia, m->familia, sizeof(resp.familia) - 1);
+    }
+
+    publicarEstado();
     AgenteInfo *ag = buscarAgente(m->agente);
+    registrarRespuesta(m, &resp, ag);
 
     pthread_mutex_unlock(&lock);
 
@@ -402,14 +1347,197 @@ void procesarSolicitud(Mensaje *m) {
         fprintf(stderr, "Controlador: no se encontro agente %s para responder\n", m->agente);
     }
 
-    printf("Controlador: peticion de agente %s, familia %s, hora %d, personas %d -> codigoRespuesta=%d, horaAsignada=%d\n",
-           m->agente, m->familia, m->hora, m->personas, resp.codigoRespuesta, resp.horaAsignada);
+    printf("Controlador: modificacion de agente %s, idReserva %d, hora %d, personas %d -> codigoRespuesta=%d, horaAsignada=%d\n",
+           m->agente, m->idReserva, m->hora, m->personas, resp.codigoRespuesta, resp.horaAsignada);
+}
+
+/* ============================
+   Cola de admision
+   ============================ */
+
+/* Bloquea al lector si la cola esta llena: la presion llega hasta los
+   agentes via el pipe en lugar de crecer sin limite en memoria. */
+void encolarMensaje(ColaMensajes *c, Mensaje *m) {
+    while (c->cantidad == c->capacidad) {
+        pthread_cond_wait(&condColaNoLlena, &lockCola);
+    }
+    c->mensajes[(c->inicio + c->cantidad) % c->capacidad] = *m;
+    c->cantidad++;
+    totalEncolados++;
+    if (totalEncolados > profundidadMaxCola) profundidadMaxCola = totalEncolados;
+    pthread_cond_signal(&condColaNoVacia);
+}
+
+/* Se llama solo con c->cantidad > 0 */
+void desencolarMensaje(ColaMensajes *c, Mensaje *m) {
+    *m = c->mensajes[c->inicio];
+    c->inicio = (c->inicio + 1) % c->capacidad;
+    c->cantidad--;
+    totalEncolados--;
+    pthread_cond_broadcast(&condColaNoLlena);
+}
+
+/* Deficit round-robin entre las colas de los agentes. La cola de
+   control va primero porque registros y fin no compiten por aforo.
+   Cada agente recibe 'peso' mensajes de credito al llegarle el turno y
+   lo pierde si vacia su cola. */
+void siguienteMensaje(Mensaje *m) {
+    pthread_mutex_lock(&lockCola);
+
+    while (totalEncolados == 0) {
+        pthread_cond_wait(&condColaNoVacia, &lockCola);
+    }
+
+    if (colaControl.cantidad > 0) {
+        desencolarMensaje(&colaControl, m);
+        pthread_mutex_unlock(&lockCola);
+        return;
+    }
+
+    if (!turnoDRR) {
+        turnoDRR = listaAgentes;
+        turnoDRR->deficit += turnoDRR->peso;
+    }
+
+    while (turnoDRR->cola.cantidad == 0 || turnoDRR->deficit < 1) {
+        if (turnoDRR->cola.cantidad == 0) turnoDRR->deficit = 0;
+        turnoDRR = turnoDRR->sig ? turnoDRR->sig : listaAgentes;
+        if (turnoDRR->cola.cantidad > 0) turnoDRR->deficit += turnoDRR->peso;
+    }
+
+    desencolarMensaje(&turnoDRR->cola, m);
+    turnoDRR->deficit--;
+    turnoDRR->atendidas++;
+
+    pthread_mutex_unlock(&lockCola);
+}
+
+/* Token bucket con rafaga de max(1, tasa). Con lockCola tomado.
+   Retorna 0 si hay token, o los ms hasta el proximo token. */
+int consumirToken(AgenteInfo *ag) {
+    if (ag->tasa <= 0) return 0;
+
+    struct timespec ahora;
+    clock_gettime(CLOCK_MONOTONIC, &ahora);
+    double transcurrido = (ahora.tv_sec - ag->ultimaRecarga.tv_sec) +
+                          (ahora.tv_nsec - ag->ultimaRecarga.tv_nsec) / 1e9;
+    double rafaga = ag->tasa > 1.0 ? ag->tasa : 1.0;
+
+    ag->ultimaRecarga = ahora;
+    ag->tokens += transcurrido * ag->tasa;
+    if (ag->tokens > rafaga) ag->tokens = rafaga;
+
+    if (ag->tokens >= 1.0) {
+        ag->tokens -= 1.0;
+        return 0;
+    }
+    return (int)((1.0 - ag->tokens) / ag->tasa * 1000.0) + 1;
+}
+
+/* Carga de un agente relativa a su peso si se le encolara un mensaje
+   mas. Con lockCola tomado. */
+static double cargaPonderada(const AgenteInfo *a, int extra) {
+    return (double)(a->cola.cantidad + extra) / a->peso;
+}
+
+/* Por encima de la marca alta se descarta al agente mas cargado: el que,
+   con este mensaje, quedaria con al menos tanta cola por unidad de peso
+   como cualquier otro. Un agente normal tiene a lo sumo una solicitud
+   en vuelo, asi que con pesos iguales se descarta a todos por igual y
+   un agente de mas peso conserva su parte. Con lockCola tomado. */
+static int esMasCargado(const AgenteInfo *ag) {
+    double propia = cargaPonderada(ag, 1);
+    for (AgenteInfo *a = listaAgentes; a; a = a->sig) {
+        if (a != ag && cargaPonderada(a, 0) > propia) return 0;
+    }
+    return 1;
+}
+
+/* Encola m en la cola de su agente o retorna los ms sugeridos para que
+   el lector responda OCUPADO. Se descarta si el agente excede su tasa o
+   si, por encima de la marca alta, es el mas cargado segun su peso.
+   Registros, bajas y el fin nunca se descartan; las cancelaciones solo
+   si la cola del agente esta llena. Retorna 0 si encolo. */
+int admitirOSobrecarga(Mensaje *m) {
+    int descartable = (m->tipo == MSG_SOLICITUD || m->tipo == MSG_MODIFICAR);
+
+    pthread_mutex_lock(&lockCola);
+
+    /* La baja va por la cola de control: el agente solo la envia despues
+       de recibir todas sus respuestas */
+    AgenteInfo *ag = (m->tipo == MSG_REGISTRO || m->tipo == MSG_BAJA) ? NULL : buscarAgente(m->agente);
+    ColaMensajes *cola = ag ? &ag->cola : &colaControl;
+
+    /* Nunca se bloquea al lector en la cola de un agente, que podria
+       darse de baja mientras tanto: si esta llena, el agente reintenta */
+    if (ag && !descartable && ag->cola.cantidad == ag->cola.capacidad) {
+        cantRechazadasOcupado++;
+        pthread_mutex_unlock(&lockCola);
+        return REINTENTO_MS_BASE;
+    }
+
+    if (descartable && ag) {
+        int esperaToken = consumirToken(ag);
+        if (esperaToken > 0) {
+            ag->limitadas++;
+            pthread_mutex_unlock(&lockCola);
+            return esperaToken;
+        }
+
+        int profundidad = totalEncolados;
+        if (profundidad >= marcaAlta) enSobrecarga = 1;
+        else if (profundidad <= marcaBaja) enSobrecarga = 0;
+
+        if ((enSobrecarga && esMasCargado(ag)) || ag->cola.cantidad == ag->cola.capacidad) {
+            cantRechazadasOcupado++;
+            pthread_mutex_unlock(&lockCola);
+            /* Sugerencia proporcional a lo que falta para volver bajo la marca baja */
+            return REINTENTO_MS_BASE * (1 + (profundidad - marcaBaja) / (marcaBaja > 0 ? marcaBaja : 1));
+        }
+    }
+
+    encolarMensaje(cola, m);
+    if (ag) {
+        ag->encoladas++;
+        if (ag->cola.cantidad > ag->maxCola) ag->maxCola = ag->cola.cantidad;
+    }
+    pthread_mutex_unlock(&lockCola);
+    return 0;
+}
+
+void responderOcupado(Mensaje *m, int reintentarMs) {
+    Mensaje resp;
+    memset(&resp, 0, sizeof(Mensaje));
+    resp.tipo = MSG_RESPUESTA;
+    strncpy(resp.agente, m->agente, sizeof(resp.agente) - 1);
+    strncpy(resp.familia, m->familia, sizeof(resp.familia) - 1);
+    resp.hora = m->hora;
+    resp.personas = m->personas;
+    resp.idReserva = m->idReserva;
+    resp.horaAsignada = -1;
+    resp.codigoRespuesta = 8;
+    resp.reintentarMs = reintentarMs;
+    resp.secuencia = m->secuencia;
+
+    /* El hilo de admision puede dar de baja al agente y cerrar su pipe:
+       se escribe sobre un duplicado, fuera del lock */
+    pthread_mutex_lock(&lock);
+    AgenteInfo *ag = buscarAgente(m->agente);
+    int fd = (ag && ag->fdRespuesta != -1) ? dup(ag->fdRespuesta) : -1;
+    pthread_mutex_unlock(&lock);
+
+    if (fd != -1) {
+        enviarMensaje(fd, &resp);
+        close(fd);
+    }
 }
 
 /* ============================
    Hilos
    ============================ */
 
+/* Lector: solo drena el pipe hacia la cola acotada. Un MSG_FIN en el
+   pipe principal lo escribe el propio reloj para despertarlo al final. */
 void *hiloSolicitudes(void *arg) {
     (void)arg;
     Mensaje m;
@@ -421,21 +1549,60 @@ void *hiloSolicitudes(void *arg) {
             continue;
         }
 
-        if (m.tipo == MSG_REGISTRO) {
+        if (m.tipo == MSG_FIN) {
+            pthread_mutex_lock(&lockCola);
+            encolarMensaje(&colaControl, &m);
+            pthread_mutex_unlock(&lockCola);
+            break;
+        }
+
+        int reintentarMs = admitirOSobrecarga(&m);
+        if (reintentarMs > 0) {
+            responderOcupado(&m, reintentarMs);
+        }
+    }
+
+    return NULL;
+}
+
+void *hiloAdmision(void *arg) {
+    (void)arg;
+    Mensaje m;
+
+    while (1) {
+        siguienteMensaje(&m);
+
+        if (m.tipo == MSG_FIN) {
+            break;
+        } else if (m.tipo != MSG_REGISTRO && m.tipo != MSG_BAJA && reenviarSiDuplicado(&m)) {
+            continue;
+        } else if (m.tipo == MSG_REGISTRO) {
             procesarRegistro(&m);
+        } else if (m.tipo == MSG_BAJA) {
+            procesarBaja(&m);
         } else if (m.tipo == MSG_SOLICITUD) {
             procesarSolicitud(&m);
+        } else if (m.tipo == MSG_CANCELAR) {
+            procesarCancelacion(&m);
+        } else if (m.tipo == MSG_MODIFICAR) {
+            procesarModificacion(&m);
         }
     }
 
     return NULL;
 }
 
+/* El snapshot se toma dentro del lock y se imprime fuera, para que la
+   salida por terminal no frene la admision en cada tick */
 void *hiloReloj(void *arg) {
     (void)arg;
+    SnapshotHora snapshot;
+    memset(&snapshot, 0, sizeof(SnapshotHora));
+    int esperaMs = esperaPrimeraHoraMs;
 
     while (1) {
-        sleep(horaPorSegundo);
+        dormirMs(esperaMs);
+        esperaMs = horaPorSegundo * 1000;
 
         pthread_mutex_lock(&lock);
 
@@ -445,17 +1612,45 @@ void *hiloReloj(void *arg) {
         }
 
         parque.horaActual++;
-        imprimirEstadoHora();
+        publicarEstado();
+        tomarSnapshotHora(&snapshot);
+
+        Mensaje tick;
+        memset(&tick, 0, sizeof(Mensaje));
+        tick.hora = parque.horaActual;
+        replicar(REP_TICK, &tick);
+        if (replica) atomic_store_explicit(&replica->inicioHora, ahoraMs(), memory_order_relaxed);
 
         pthread_mutex_unlock(&lock);
+
+        imprimirSnapshotHora(&snapshot);
     }
+    liberarSnapshotHora(&snapshot);
 
+    pthread_mutex_lock(&lock);
     simulacionActiva = 0;
+    publicarEstado();
+    replicar(REP_FIN, NULL);
+    pthread_mutex_unlock(&lock);
+
     enviarMensajeFinAgentes();
 
-    if (fdPrincipal != -1) {
-        close(fdPrincipal);
-        fdPrincipal = -1;
+    /* Despierta al lector, que puede estar bloqueado en read() */
+    Mensaje fin;
+    memset(&fin, 0, sizeof(Mensaje));
+    fin.tipo = MSG_FIN;
+    enviarMensaje(fdPrincipal, &fin);
+
+    return NULL;
+}
+
+/* Mientras dure la simulacion el standby ve avanzar 'latido' */
+void *hiloLatido(void *arg) {
+    (void)arg;
+
+    while (simulacionActiva) {
+        atomic_store_explicit(&replica->latido, ahoraMs(), memory_order_relaxed);
+        dormirMs(PERIODO_LATIDO_MS);
     }
 
     return NULL;
@@ -467,7 +1662,9 @@ void *hiloReloj(void *arg) {
 
 static void imprimirUso(const char *prog) {
     fprintf(stderr,
-            "Uso: %s -i horaIni -f horaFin -s segHoras -t aforo -p pipeRecibe\n",
+            "Uso: %s -i horaIni -f horaFin -s segHoras -t aforo -p pipeRecibe "
+            "[-H marcaAlta] [-L marcaBaja] [-w agente:peso,...] [-r agente:solicitudesPorSeg,...] "
+            "[--standby]\n",
             prog);
 }
 
@@ -478,16 +1675,25 @@ void inicializarControlador(int horaIni, int horaFin, int segHoras, int aforo, c
     parque.horaIni = horaIni;
     parque.horaFin = horaFin;
     parque.aforo = aforo;
+    parque.sigIdReserva = 1;
 
     horaPorSegundo = segHoras;
+    esperaPrimeraHoraMs = segHoras * 1000;
     strncpy(pipePrincipal, pipeRecibe, sizeof(pipePrincipal) - 1);
 
     crearPipeSiNoExiste(pipeRecibe);
 
+    /* El standby tambien lo abre desde el inicio: asi los agentes nunca
+       quedan sin lector (EPIPE) durante la conmutacion */
     fdPrincipal = open(pipeRecibe, O_RDWR);
     if (fdPrincipal == -1) {
         error("open pipeRecibe O_RDWR");
     }
+
+    /* Holgura sobre la marca alta para mensajes que nunca se descartan */
+    colaControl.capacidad = marcaAlta * 2;
+    colaControl.mensajes = (Mensaje *)calloc(colaControl.capacidad, sizeof(Mensaje));
+    if (!colaControl.mensajes) error("calloc colaControl");
 }
 
 int main(int argc, char *argv[]) {
@@ -496,9 +1702,18 @@ int main(int argc, char *argv[]) {
 
     int opt;
     int flagI = 0, flagF = 0, flagS = 0, flagT = 0, flagP = 0;
+    int modoStandby = 0;
 
-    while ((opt = getopt(argc, argv, "i:f:s:t:p:")) != -1) {
+    static struct option opcionesLargas[] = {
+        {"standby", no_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "i:f:s:t:p:H:L:w:r:", opcionesLargas, NULL)) != -1) {
         switch (opt) {
+            case 'S':
+                modoStandby = 1;
+                break;
             case 'i':
                 horaIni = atoi(optarg);
                 flagI = 1;
@@ -520,6 +1735,18 @@ int main(int argc, char *argv[]) {
                 pipeRecibe[sizeof(pipeRecibe) - 1] = '\0';
                 flagP = 1;
                 break;
+            case 'H':
+                marcaAlta = atoi(optarg);
+                break;
+            case 'L':
+                marcaBaja = atoi(optarg);
+                break;
+            case 'w':
+                cargarConfigAgentes(optarg, 1);
+                break;
+            case 'r':
+                cargarConfigAgentes(optarg, 0);
+                break;
             default:
                 imprimirUso(argv[0]);
                 exit(EXIT_FAILURE);
@@ -533,35 +1760,89 @@ int main(int argc, char *argv[]) {
 
     if (horaIni < MIN_HORA || horaIni > MAX_HORA ||
         horaFin < MIN_HORA || horaFin > MAX_HORA ||
-        horaIni > horaFin || segHoras <= 0 || aforo <= 0) {
+        horaIni > horaFin || segHoras <= 0 || aforo <= 0 ||
+        marcaAlta <= 0 || marcaBaja < 0 || marcaBaja >= marcaAlta) {
         fprintf(stderr, "Parametros invalidos.\n");
         imprimirUso(argv[0]);
         exit(EXIT_FAILURE);
     }
 
+    signal(SIGPIPE, SIG_IGN);
     inicializarControlador(horaIni, horaFin, segHoras, aforo, pipeRecibe);
 
-    pthread_t thSolicitudes, thReloj;
-    pthread_create(&thSolicitudes, NULL, hiloSolicitudes, NULL);
-    pthread_create(&thReloj, NULL, hiloReloj, NULL);
+    int atender = 1;
+    if (modoStandby) {
+        esPrimario = 0;
+        abrirReplica(pipeRecibe);
+        atender = seguirPrimario();
+        if (atender) tomarControl();
+    } else {
+        crearReplica(pipeRecibe);
+    }
+
+    if (atender) {
+        crearEstadoCompartido(pipeRecibe);
+        pthread_mutex_lock(&lock);
+        publicarEstado();
+        pthread_mutex_unlock(&lock);
 
-    pthread_join(thSolicitudes, NULL);
-    pthread_join(thReloj, NULL);
+        pthread_t thSolicitudes, thAdmision, thReloj, thLatido;
+        pthread_create(&thSolicitudes, NULL, hiloSolicitudes, NULL);
+        pthread_create(&thAdmision, NULL, hiloAdmision, NULL);
+        pthread_create(&thReloj, NULL, hiloReloj, NULL);
+        pthread_create(&thLatido, NULL, hiloLatido, NULL);
 
-    generarReporteFinal();
+        pthread_join(thSolicitudes, NULL);
+        pthread_join(thAdmision, NULL);
+        pthread_join(thReloj, NULL);
+        pthread_join(thLatido, NULL);
 
-    Reserva *r = parque.reservas;
-    while (r) {
-        Reserva *tmp = r;
-        r = r->sig;
-        free(tmp);
+        destruirEstadoCompartido();
+        destruirReplica();
+
+        SnapshotReporte reporte;
+        tomarSnapshotReporte(&reporte);
+        generarReporteFinal(&reporte);
+        free(reporte.agentes);
+    } else {
+        printf("Controlador standby: el primario termino la simulacion.\n");
+        munmap(replica, sizeof(SegmentoReplica));
+    }
+
+    close(fdPrincipal);
+    fdPrincipal = -1;
+    free(colaControl.mensajes);
+
+    for (int h = 0; h < 24; h++) {
+        Reserva *r = parque.reservasPorHora[h];
+        while (r) {
+            Reserva *tmp = r;
+            r = r->sig;
+            free(tmp);
+        }
     }
+    free(parque.tablaReservas);
 
     AgenteInfo *a = listaAgentes;
     while (a) {
         AgenteInfo *tmp = a;
         if (tmp->fdRespuesta != -1) close(tmp->fdRespuesta);
         a = a->sig;
+        free(tmp->cola.mensajes);
+        free(tmp);
+    }
+
+    AgenteRetirado *ret = agentesRetirados;
+    while (ret) {
+        AgenteRetirado *tmp = ret;
+        ret = ret->sig;
+        free(tmp);
+    }
+
+    ConfigAgente *c = configAgentes;
+    while (c) {
+        ConfigAgente *tmp = c;
+        c = c->sig;
         free(tmp);
     }
 